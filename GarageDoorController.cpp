@@ -24,6 +24,20 @@ SOFTWARE.
 
 #include "GarageDoorController.h"
 
+// In path hash order for find_route's binary search
+static constexpr HttpRoute CONTROLLER_ROUTES[] = {
+  HTTP_ROUTE(HTTP_METHOD_PUT, "/controller/door/open", GarageDoorController::ROUTE_DOOR_OPEN),
+  HTTP_ROUTE(HTTP_METHOD_GET, "/controller", GarageDoorController::ROUTE_STATUS),
+  HTTP_ROUTE(HTTP_METHOD_GET, "/controller/poll", GarageDoorController::ROUTE_POLL),
+  HTTP_ROUTE(HTTP_METHOD_PUT, "/controller/light/off", GarageDoorController::ROUTE_LIGHT_OFF),
+  HTTP_ROUTE(HTTP_METHOD_PUT, "/controller/door/close", GarageDoorController::ROUTE_DOOR_CLOSE),
+  HTTP_ROUTE(HTTP_METHOD_GET, "/controller/events", GarageDoorController::ROUTE_EVENTS),
+  HTTP_ROUTE(HTTP_METHOD_PUT, "/controller/light/on", GarageDoorController::ROUTE_LIGHT_ON),
+  HTTP_ROUTE(HTTP_METHOD_GET, "/controller/ws", GarageDoorController::ROUTE_WEBSOCKET)
+};
+
+static_assert(http_routes_sorted(CONTROLLER_ROUTES, sizeof(CONTROLLER_ROUTES) / sizeof(CONTROLLER_ROUTES[0])), "CONTROLLER_ROUTES must be in path hash order");
+
 GarageDoorController::GarageDoorController()
 {
   this->_sensorOpenDebouncer = new Bounce();
@@ -70,12 +84,21 @@ void GarageDoorController::loop()
   // Update states
   LOGPRINTLN_TRACE("Calling _monitorInputs()");
   this->_monitorInputs();
+
+  // Advance any door output pulses, then perform queued actions
+  this->_updatePulses();
+  this->_performActions();
 }
 
 void GarageDoorController::operateDoor(bool state)
 {
   LOGPRINTLN_VERBOSE("Entered operateDoor()");
 
+  if (this->_pulseCycles > 0) {
+    LOGPRINTLN_DEBUG("Door output already pulsing, ignored");
+    return;
+  }
+
   uint8_t pin = 0;
   uint8_t cycles = 0;
   uint8_t DOOR_OUTPUT_PIN = DOOR_OUTPUT_OPEN_PIN;
@@ -161,52 +184,142 @@ void GarageDoorController::getJsonStatus(char *const dest, size_t destSize)
   jsonRoot.printTo(dest, destSize);
 }
 
-uint16_t GarageDoorController::requestHandler(Client &client, const char *requestMethod, const char *requestUrl, HashMap<char *, char *, 24> &requestQuery)
+uint32_t GarageDoorController::getStateVersion()
+{
+  LOGPRINTLN_TRACE("Entered getStateVersion()");
+
+  // Everything reported by getJsonStatus(), door state is offset from -1 into 3 bits
+  uint8_t snapshot = (this->SensorOpen << 0) | (this->SensorClosed << 1) | (this->LightInput << 2) | (this->LightRequested << 3) | (this->LightState << 4) | ((this->DoorState + 1) << 5);
+
+  if (snapshot != this->_stateSnapshot) {
+    this->_stateSnapshot = snapshot;
+    this->_stateChanges++;
+  }
+
+  // Change count in the upper bits keeps the version increasing, the snapshot in the lower bits
+  // ensures a version seen before a restart can only match an identical status
+  return (this->_stateChanges << 8) | snapshot;
+}
+
+uint16_t GarageDoorController::requestHandler(HttpRequest &request)
 {
   LOGPRINTLN_VERBOSE("Entered _requestHandler()");
+  uint16_t status;
+  const HttpRoute *route = HttpWebServer::find_route(request, CONTROLLER_ROUTES, sizeof(CONTROLLER_ROUTES) / sizeof(CONTROLLER_ROUTES[0]), status);
+
+  if (route == NULL) {
+    return status;
+  }
+
+  switch (route->id) {
+    case ROUTE_STATUS:
+    case ROUTE_POLL: {
+      uint32_t stateVersion = this->getStateVersion();
+
+      if (HttpWebServer::not_modified(request, stateVersion)) {
+        if (route->id == ROUTE_POLL) {
+          // Hold the request until the state changes, or answer 304 on timeout
+          return HttpWebServer::begin_long_poll(request, stateVersion, HTTP_LONG_POLL_TIMEOUT);
+        }
+
+        HttpWebServer::send_response(request, 304, NULL, 0, stateVersion);
+        return 0;
+      }
 
-  if (strcmp(requestMethod, "GET") == 0) {
-    if (strcasecmp(requestUrl, "/controller") == 0) {
       char jsonStatus[256];
       this->getJsonStatus(jsonStatus, sizeof(jsonStatus));
-      HttpWebServer::send_response(client, 200, (uint8_t *)jsonStatus, strlen(jsonStatus));
+      HttpWebServer::send_response(request, 200, (uint8_t *)jsonStatus, strlen(jsonStatus), stateVersion);
       return 0;
+    }
+
+    case ROUTE_EVENTS: {
+      char jsonStatus[256];
+      this->getJsonStatus(jsonStatus, sizeof(jsonStatus));
+      return HttpWebServer::begin_event_stream(request, (uint8_t *)jsonStatus, strlen(jsonStatus), this->getStateVersion());
+    }
 
-    } else {
-      return 404;
+    case ROUTE_WEBSOCKET: {
+      char jsonStatus[256];
+      this->getJsonStatus(jsonStatus, sizeof(jsonStatus));
+      return HttpWebServer::begin_websocket(request, (uint8_t *)jsonStatus, strlen(jsonStatus), this->getStateVersion());
     }
-  } else if (strcmp(requestMethod, "PUT") == 0) {
-    if ((strcasecmp(requestUrl, "/controller/light/on") == 0) || (strcasecmp(requestUrl, "/controller/light/off") == 0)) {
-      if (striendswith(requestUrl, "/on")) {
-        this->LightRequested = true;
-      } else if (striendswith(requestUrl, "off")) {
-        this->LightRequested = false;
-      }
 
-      // Switch the light
-      this->LightState = (this->LightInput || this->LightRequested);
-      this->switchLight(this->LightState);
-      return 202;
+    default:
+      return this->_queueAction(route->id);
+  }
+}
+
+uint16_t GarageDoorController::commandHandler(HttpSpan &command)
+{
+  LOGPRINTLN_VERBOSE("Entered commandHandler()");
+
+  // Commands name the same actions as the PUT routes, relative to /controller/
+  if (command.equals_ignore_case("light/on")) {
+    return this->_queueAction(ROUTE_LIGHT_ON);
+  } else if (command.equals_ignore_case("light/off")) {
+    return this->_queueAction(ROUTE_LIGHT_OFF);
+  } else if (command.equals_ignore_case("door/open")) {
+    return this->_queueAction(ROUTE_DOOR_OPEN);
+  } else if (command.equals_ignore_case("door/close")) {
+    return this->_queueAction(ROUTE_DOOR_CLOSE);
+  }
+
+  return 404;
+}
 
-    } else if ((strcasecmp(requestUrl, "/controller/door/open") == 0) || (strcasecmp(requestUrl, "/controller/door/close") == 0)) {
-      bool doorOpen = false;
+uint16_t GarageDoorController::_queueAction(uint8_t action)
+{
+  LOGPRINTLN_VERBOSE("Entered _queueAction()");
 
-      if (striendswith(requestUrl, "/open")) {
-        doorOpen = true;
-      } else if (striendswith(requestUrl, "/close")) {
-        doorOpen = false;
-      }
+  if ((action != ROUTE_LIGHT_ON) && (action != ROUTE_LIGHT_OFF) && (action != ROUTE_DOOR_OPEN) && (action != ROUTE_DOOR_CLOSE)) {
+    return 404;
+  }
+
+  if (this->_actionCount >= CONTROLLER_ACTION_QUEUE_SIZE) {
+    LOGPRINTLN_DEBUG("Action queue full");
+    return 503;
+  }
+
+  // Performed from loop(), so the response goes out before any relay is pulsed
+  this->_actions[(this->_actionFirst + this->_actionCount) % CONTROLLER_ACTION_QUEUE_SIZE] = action;
+  this->_actionCount++;
+  return 202;
+}
+
+void GarageDoorController::_performActions()
+{
+  // Light actions run straight away, door actions run in the order queued once the previous pulses have finished
+  uint8_t actionsWaiting = 0;
 
-      // Operate the door
-      this->operateDoor(doorOpen);
-      return 202;
+  for (uint8_t i = 0; i < this->_actionCount; i++) {
+    uint8_t action = this->_actions[(this->_actionFirst + i) % CONTROLLER_ACTION_QUEUE_SIZE];
 
-    } else {
-      return 404;
+    if (((action == ROUTE_DOOR_OPEN) || (action == ROUTE_DOOR_CLOSE)) && (this->_pulseCycles > 0)) {
+      // Kept in the queue, closing up behind any actions already performed
+      this->_actions[(this->_actionFirst + actionsWaiting) % CONTROLLER_ACTION_QUEUE_SIZE] = action;
+      actionsWaiting++;
+      continue;
+    }
+
+    switch (action) {
+      case ROUTE_LIGHT_ON:
+      case ROUTE_LIGHT_OFF:
+        this->LightRequested = (action == ROUTE_LIGHT_ON);
+
+        // Switch the light
+        this->LightState = (this->LightInput || this->LightRequested);
+        this->switchLight(this->LightState);
+        break;
+
+      case ROUTE_DOOR_OPEN:
+      case ROUTE_DOOR_CLOSE:
+        // Operate the door
+        this->operateDoor(action == ROUTE_DOOR_OPEN);
+        break;
     }
-  } else {
-    return 405;
   }
+
+  this->_actionCount = actionsWaiting;
 }
 
 char *GarageDoorController::stringFromDoorState(enum DoorState doorState)
@@ -330,16 +443,35 @@ void GarageDoorController::_operateDoor(uint8_t pin, uint8_t cycles)
 {
   LOGPRINTLN_VERBOSE("Entered _operateDoor()");
 
-  for (uint8_t i = 0; i < cycles; i++) {
-    if (i != 0) {
-      delay(DOOR_OUTPUT_PULSE_DELAY_TIME);
-    }
+  // Pulses are timed from loop() rather than with delay(), so requests are still served meanwhile
+  this->_pulsePin = pin;
+  this->_pulseCycles = cycles;
+  this->_pulseHigh = false;
+  this->_pulseNextTime = millis();
+  this->_updatePulses();
+}
+
+void GarageDoorController::_updatePulses()
+{
+  uint32_t timeNow = millis();
 
-    digitalWrite(pin, HIGH);
-    delay(DOOR_OUTPUT_PULSE_TIME);
-    digitalWrite(pin, LOW);
+  if ((this->_pulseCycles == 0) || ((int32_t)(timeNow - this->_pulseNextTime) < 0)) {
+    return;
+  }
+
+  // Sensors are ignored while pulsing, and for DOOR_SENSOR_REACT_TIME after
+  this->DoorTimeLastOperated = timeNow;
+
+  if (!this->_pulseHigh) {
+    digitalWrite(this->_pulsePin, HIGH);
+    this->_pulseHigh = true;
+    this->_pulseNextTime = timeNow + DOOR_OUTPUT_PULSE_TIME;
+    return;
   }
 
-  this->DoorTimeLastOperated = millis();
+  digitalWrite(this->_pulsePin, LOW);
+  this->_pulseHigh = false;
+  this->_pulseCycles--;
+  this->_pulseNextTime = timeNow + DOOR_OUTPUT_PULSE_DELAY_TIME;
 }
 
@@ -12,10 +12,13 @@
 #include "compile.h"
 #include "config.h"
 
-#include "src/HashMap.h"
 #include "src/Utilities/Utilities.h"
 #include "src/HttpWebServer/HttpWebServer.h"
 
+#ifndef CONTROLLER_ACTION_QUEUE_SIZE
+  #define CONTROLLER_ACTION_QUEUE_SIZE 4
+#endif
+
 class GarageDoorController
 {
   public:
@@ -32,6 +35,17 @@ class GarageDoorController
       DOORSTATE_UNKNOWN = -1
     };
 
+    enum Route {
+      ROUTE_STATUS,
+      ROUTE_EVENTS,
+      ROUTE_POLL,
+      ROUTE_WEBSOCKET,
+      ROUTE_LIGHT_ON,
+      ROUTE_LIGHT_OFF,
+      ROUTE_DOOR_OPEN,
+      ROUTE_DOOR_CLOSE
+    };
+
     bool SensorOpen;
     bool SensorClosed;
     bool LightInput;
@@ -48,16 +62,32 @@ class GarageDoorController
     void operateDoor(bool state);
     void switchLight(bool state);
     void getJsonStatus(char *const dest, size_t destSize);
+    uint32_t getStateVersion();
     char *stringFromDoorState(enum DoorState doorState);
-    uint16_t requestHandler(Client &client, const char *requestMethod, const char *requestUrl, HashMap<char *, char *, 24> &requestQuery);
+    uint16_t requestHandler(HttpRequest &request);
+    uint16_t commandHandler(HttpSpan &command);
 
   private:
     Bounce *_sensorOpenDebouncer;
     Bounce *_sensorClosedDebouncer;
     Bounce *_lightInputDebouncer;
+    uint32_t _stateChanges = 0;
+    uint8_t _stateSnapshot = 0xFF;
+
+    uint8_t _actions[CONTROLLER_ACTION_QUEUE_SIZE];
+    uint8_t _actionFirst = 0;
+    uint8_t _actionCount = 0;
+
+    uint8_t _pulsePin = 0;
+    uint8_t _pulseCycles = 0;
+    bool _pulseHigh = false;
+    uint32_t _pulseNextTime = 0;
 
     void _monitorInputs();
     void _operateDoor(uint8_t pin, uint8_t cycles);
+    void _updatePulses();
+    uint16_t _queueAction(uint8_t action);
+    void _performActions();
 };
 
 #endif // GARAGEDOORCONTROLLER_H
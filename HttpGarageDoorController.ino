@@ -60,6 +60,21 @@ WiFiHelper gWiFiHelper(MDNS_NAME, WIFI_SSID, WIFI_PASSWORD, WIFI_CONNECTION_TIME
 WiFiServer gServer(HTTP_SERVER_PORT);
 HttpWebServer gHttpWebServer(gServer, HTTP_SERVER_PORT, HTTP_REQUEST_TIMEOUT, HTTP_REQUEST_BUFFER_SIZE);
 
+char gJsonDeviceInfo[256];
+uint32_t gDeviceInfoVersion = 0;
+uint32_t gStateVersionPublished = 0;
+
+enum DeviceRoute {
+  ROUTE_DEVICE_INFO
+};
+
+// In path hash order for find_route's binary search
+static constexpr HttpRoute DEVICE_ROUTES[] = {
+  HTTP_ROUTE(HTTP_METHOD_GET, "/device", ROUTE_DEVICE_INFO)
+};
+
+static_assert(http_routes_sorted(DEVICE_ROUTES, sizeof(DEVICE_ROUTES) / sizeof(DEVICE_ROUTES[0])), "DEVICE_ROUTES must be in path hash order");
+
 
 // SETUP
 void setup()
@@ -74,13 +89,16 @@ void setup()
 
   LOGPRINTLN_TRACE("Entered setup()");
   gWiFiHelper.enable_led(LED_BUILTIN, LED_BUILTIN_ON, LED_BUILTIN_OFF, false);
+  gHttpWebServer.enable_keep_alive(HTTP_KEEPALIVE_TIMEOUT, HTTP_KEEPALIVE_MAX_REQUESTS);
+  gHttpWebServer.enable_rate_limit(HTTP_RATE_LIMIT_BURST, HTTP_RATE_LIMIT_INTERVAL);
+  gHttpWebServer.enable_websockets(websocketHandler);
 
 #ifdef ENABLE_HTTP_SERVER_APIKEY_HEADER_AUTH
   gHttpWebServer.enable_apikey_header_auth(HTTP_SERVER_APIKEY_HEADER);
 #endif
 
 #ifdef ENABLE_HTTP_SERVER_OAUTH_AUTH
-  gHttpWebServer.enable_oauth_auth(gUdp, HTTP_SERVER_OAUTH_CONSUMER_KEY, HTTP_SERVER_OAUTH_CONSUMER_SECRET, OAUTH_NONCE_SIZE, OAUTH_NONCE_HISTORY, OAUTH_TIMESTAMP_VALIDITY_WINDOW);
+  gHttpWebServer.enable_oauth_auth(gUdp, HTTP_SERVER_OAUTH_CONSUMER_KEY, HTTP_SERVER_OAUTH_CONSUMER_SECRET, OAUTH_NONCE_HISTORY, OAUTH_TIMESTAMP_VALIDITY_WINDOW);
 #endif
 
   // Setup Controller
@@ -123,6 +141,10 @@ bool connectWiFi()
   gHttpWebServer.begin();
   LOGPRINTLN_INFO("started!");
 
+  // Device info only changes with the connection, render it once per connection
+  getJsonDeviceInfo(gJsonDeviceInfo, sizeof(gJsonDeviceInfo));
+  gDeviceInfoVersion = http_hash(gJsonDeviceInfo);
+
 #ifdef ENABLE_HTTP_SERVER_OAUTH_AUTH
   LOGPRINT_INFO("Initalising clock...");
 
@@ -162,16 +184,34 @@ void getJsonDeviceInfo(char *const jsonDeviceInfo, size_t jsonDeviceInfoSize)
   jsonRoot.printTo(jsonDeviceInfo, jsonDeviceInfoSize);
 }
 
-uint16_t requestHandler(Client &client, const char *requestMethod, const char *requestUrl, HashMap<char *, char *, 24> &requestQuery)
+uint16_t requestHandler(HttpRequest &request)
 {
-  if ((strcmp(requestMethod, "GET") == 0) && (strcasecmp(requestUrl, "/device") == 0)) {
-    char jsonDeviceInfo[256];
-    getJsonDeviceInfo(jsonDeviceInfo, sizeof(jsonDeviceInfo));
-    HttpWebServer::send_response(client, 200, (uint8_t *)jsonDeviceInfo, strlen(jsonDeviceInfo));
-    return 0;
+  uint16_t status;
+  const HttpRoute *route = HttpWebServer::find_route(request, DEVICE_ROUTES, sizeof(DEVICE_ROUTES) / sizeof(DEVICE_ROUTES[0]), status);
+
+  if (route == NULL) {
+    // Not a device route, pass to the controller
+    return (status == 405) ? status : gController.requestHandler(request);
+  }
+
+  switch (route->id) {
+    case ROUTE_DEVICE_INFO:
+      if (HttpWebServer::not_modified(request, gDeviceInfoVersion)) {
+        HttpWebServer::send_response(request, 304, NULL, 0, gDeviceInfoVersion);
+        return 0;
+      }
+
+      HttpWebServer::send_response(request, 200, (uint8_t *)gJsonDeviceInfo, strlen(gJsonDeviceInfo), gDeviceInfoVersion);
+      return 0;
+
+    default:
+      return 404;
   }
-  
-  return gController.requestHandler(client, requestMethod, requestUrl, requestQuery);
+}
+
+uint16_t websocketHandler(HttpSpan &message)
+{
+  return gController.commandHandler(message);
 }
 
 // MAIN LOOP
@@ -198,20 +238,18 @@ void loop()
 
     // Handle incoming HTTP/aREST requests
     LOGPRINTLN_TRACE("Calling gHttpWebServer.poll()");
-    WiFiClient client = gServer.available();
+    gHttpWebServer.poll(requestHandler);
 
-#ifdef ESP8266
+    // Push controller state changes to event stream and long poll clients
+    uint32_t stateVersion = gController.getStateVersion();
 
-    if (client != NULL) {
-      LOGPRINT_INFO("\nAccepted new client connection from ");
-      LOGPRINT_INFO((IPAddress)client.remoteIP());
-      LOGPRINT_INFO(":");
-      LOGPRINTLN_INFO(client.remotePort());
-    }
+    if (stateVersion != gStateVersionPublished) {
+      gStateVersionPublished = stateVersion;
 
-#endif
-
-    gHttpWebServer.poll(client, requestHandler);
+      char jsonStatus[256];
+      gController.getJsonStatus(jsonStatus, sizeof(jsonStatus));
+      gHttpWebServer.publish((uint8_t *)jsonStatus, strlen(jsonStatus), stateVersion);
+    }
   }
 }
-
+
@@ -23,12 +23,16 @@ const uint8_t SENSOR_CLOSED_INPUT_PIN = 4;
 const uint16_t HTTP_SERVER_PORT = 80;
 const uint16_t HTTP_REQUEST_TIMEOUT = 4000;
 const uint16_t HTTP_REQUEST_BUFFER_SIZE = 512;
+const uint16_t HTTP_KEEPALIVE_TIMEOUT = 5000;
+const uint16_t HTTP_KEEPALIVE_MAX_REQUESTS = 100;
+const uint16_t HTTP_LONG_POLL_TIMEOUT = 30000;
+const uint16_t HTTP_RATE_LIMIT_BURST = 10;
+const uint16_t HTTP_RATE_LIMIT_INTERVAL = 500;
 const uint16_t WIFI_CONNECTION_TIMEOUT = 10000;
 
 // OAuth Config
-const uint16_t OAUTH_NONCE_SIZE = 24;
 const uint16_t OAUTH_NONCE_HISTORY = 255;
-const uint16_t OAUTH_TIMESTAMP_VALIDITY_WINDOW = 300000;
+const uint32_t OAUTH_TIMESTAMP_VALIDITY_WINDOW = 300000;
 
 #endif // CONFIG
 
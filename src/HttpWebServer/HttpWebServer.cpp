@@ -24,12 +24,145 @@ SOFTWARE.
 
 #include "HttpWebServer.h"
 
-HttpWebServer::HttpWebServer(Server &server, uint16_t port, uint16_t request_timeout, uint16_t request_buffer_size)
+static const char HWS_CONNECTION_KEEP_ALIVE[] PROGMEM = "Connection: keep-alive\r\n\r\n";
+static const char HWS_CONNECTION_CLOSE[] PROGMEM = "Connection: close\r\n\r\n";
+static const char HWS_TRANSFER_ENCODING_CHUNKED[] PROGMEM = "Transfer-Encoding: chunked\r\n";
+static const char HWS_CONTENT_TYPE[] PROGMEM = "Content-Type: ";
+static const char HWS_HEAD_204[] PROGMEM = "HTTP/1.1 204 No Content\r\n";
+static const char HWS_HEAD_304[] PROGMEM = "HTTP/1.1 304 Not Modified\r\n";
+static const char HWS_HEAD_EVENT_STREAM[] PROGMEM = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: keep-alive\r\n\r\n";
+
+// Responses are assembled here so each goes out in a single write
+static uint8_t hws_response_buffer[HTTP_RESPONSE_BUFFER_SIZE];
+
+// Pre-rendered responses for each supported status, the Content-Length is checked against the body at compile time
+#define HWS_STATIC_RESPONSE(code, description, success, message, length) \
+  static const char HWS_HEAD_##code[] PROGMEM = "HTTP/1.1 " #code " " description "\r\nContent-Type: application/json\r\nContent-Length: " #length "\r\n"; \
+  static const char HWS_BODY_##code[] PROGMEM = "{\"result\":" #code ",\"success\":" #success ",\"message\":\"" message "\"}"; \
+  static const uint8_t HWS_STATUS_LENGTH_##code = sizeof(HWS_HEAD_##code) - sizeof("Content-Length: " #length "\r\n"); \
+  static_assert((sizeof(HWS_BODY_##code) - 1) == length, "Content-Length of the " #code " response does not match its body"); \
+  static_assert((sizeof(HWS_HEAD_##code) + sizeof("ETag: \"00000000\"\r\n") + sizeof(HWS_CONNECTION_KEEP_ALIVE) + sizeof(HWS_BODY_##code)) <= HTTP_RESPONSE_BUFFER_SIZE, "The " #code " response does not fit the response buffer")
+
+#define HWS_STATIC_RESPONSE_ENTRY(code) { code, HWS_HEAD_##code, sizeof(HWS_HEAD_##code) - 1, HWS_STATUS_LENGTH_##code, HWS_BODY_##code, sizeof(HWS_BODY_##code) - 1 }
+
+struct HttpStaticResponse {
+  uint16_t status;
+  const char *head;
+  uint8_t head_length;
+  uint8_t status_length;
+  const char *body;
+  uint8_t body_length;
+};
+
+HWS_STATIC_RESPONSE(501, "Not Implemented", false, "The server does not support the functionality required to fulfil the request.", 120);
+HWS_STATIC_RESPONSE(200, "OK", true, "The request has succeeded", 67);
+HWS_STATIC_RESPONSE(202, "Accepted", true, "The request has been accepted.", 72);
+HWS_STATIC_RESPONSE(400, "Bad Request", false, "The requested was bad.", 65);
+HWS_STATIC_RESPONSE(401, "Unauthorized", false, "The requested resource was unauthorised.", 83);
+HWS_STATIC_RESPONSE(403, "Forbidden", false, "The requested resource was forbidden.", 80);
+HWS_STATIC_RESPONSE(404, "Not Found", false, "The requested resource was not found.", 80);
+HWS_STATIC_RESPONSE(405, "Method Not Allowed", false, "The requested method was not allowed.", 80);
+HWS_STATIC_RESPONSE(413, "Payload Too Large", false, "The request body was too large.", 74);
+HWS_STATIC_RESPONSE(414, "URI Too Long", false, "The requested URI was too long.", 74);
+HWS_STATIC_RESPONSE(429, "Too Many Requests", false, "Too many requests, try again shortly.", 80);
+HWS_STATIC_RESPONSE(431, "Request Header Fields Too Large", false, "The request headers were too large.", 78);
+HWS_STATIC_RESPONSE(503, "Service Unavailable", false, "The server is busy, try again shortly.", 81);
+
+// The first entry is the fallback for unsupported statuses
+static const HttpStaticResponse HWS_STATIC_RESPONSES[] = {
+  HWS_STATIC_RESPONSE_ENTRY(501),
+  HWS_STATIC_RESPONSE_ENTRY(200),
+  HWS_STATIC_RESPONSE_ENTRY(202),
+  HWS_STATIC_RESPONSE_ENTRY(400),
+  HWS_STATIC_RESPONSE_ENTRY(401),
+  HWS_STATIC_RESPONSE_ENTRY(403),
+  HWS_STATIC_RESPONSE_ENTRY(404),
+  HWS_STATIC_RESPONSE_ENTRY(405),
+  HWS_STATIC_RESPONSE_ENTRY(413),
+  HWS_STATIC_RESPONSE_ENTRY(414),
+  HWS_STATIC_RESPONSE_ENTRY(429),
+  HWS_STATIC_RESPONSE_ENTRY(431),
+  HWS_STATIC_RESPONSE_ENTRY(503)
+};
+
+static const HttpStaticResponse *hws_static_response(uint16_t status)
+{
+  for (size_t i = 0; i < (sizeof(HWS_STATIC_RESPONSES) / sizeof(HWS_STATIC_RESPONSES[0])); i++) {
+    if (HWS_STATIC_RESPONSES[i].status == status) {
+      return &HWS_STATIC_RESPONSES[i];
+    }
+  }
+
+  return &HWS_STATIC_RESPONSES[0];
+}
+
+static const char *const HWS_HEADER_NAMES[HTTP_HEADER_COUNT] = {
+  "Host",
+  "Connection",
+  "Content-Length",
+  "Transfer-Encoding",
+  "X-API-Key",
+  "If-None-Match",
+  "Upgrade",
+  "Sec-WebSocket-Key",
+  "Sec-WebSocket-Version"
+};
+
+static constexpr uint32_t HWS_HEADER_HASHES[HTTP_HEADER_COUNT] = {
+  http_hash("Host"),
+  http_hash("Connection"),
+  http_hash("Content-Length"),
+  http_hash("Transfer-Encoding"),
+  http_hash("X-API-Key"),
+  http_hash("If-None-Match"),
+  http_hash("Upgrade"),
+  http_hash("Sec-WebSocket-Key"),
+  http_hash("Sec-WebSocket-Version")
+};
+
+#define HWS_WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+enum HttpWebSocketOpcode {
+  HWS_WS_CONTINUATION = 0x0,
+  HWS_WS_TEXT = 0x1,
+  HWS_WS_BINARY = 0x2,
+  HWS_WS_CLOSE = 0x8,
+  HWS_WS_PING = 0x9,
+  HWS_WS_PONG = 0xA
+};
+
+static const uint8_t HWS_WS_CLOSE_PROTOCOL_ERROR[] = { 0x03, 0xEA }; // 1002
+static const uint8_t HWS_WS_CLOSE_UNSUPPORTED[] = { 0x03, 0xEB };    // 1003
+static const uint8_t HWS_WS_CLOSE_TOO_BIG[] = { 0x03, 0xF1 };        // 1009
+
+HttpWebServer::HttpWebServer(WiFiServer &server, uint16_t port, uint16_t request_timeout, uint16_t request_buffer_size)
 {
   this->_server = &server;
   this->_port = port;
   this->_request_timeout = request_timeout;
   this->_request_buffer_size = request_buffer_size;
+
+  // Initialise request buffers, one per connection slot, kept between polls whilst a request trickles in
+  char *request_buffers = (char *)malloc(HTTP_SERVER_MAX_CONNECTIONS * this->_request_buffer_size);
+
+  if (request_buffers == NULL) {
+    LOGPRINTLN_ERROR("FATAL ERROR - Failed to allocate memory for request buffers");
+    noInterrupts();
+
+    while (true); // Kill program
+  }
+
+  for (int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
+    this->_connections[i].request = request_buffers + (i * this->_request_buffer_size);
+    this->_connections[i].stream = HWS_STREAM_NONE;
+    this->_reset_parser(this->_connections[i]);
+  }
+
+  for (int i = 0; i < HTTP_SERVER_RATE_LIMIT_CLIENTS; i++) {
+    this->_client_buckets[i].address = 0;
+  }
+
+  this->_connection_next = 0;
 }
 
 HttpWebServer::~HttpWebServer()
@@ -71,6 +204,23 @@ void HttpWebServer::stop()
 #endif
 }
 
+void HttpWebServer::enable_keep_alive(uint16_t keep_alive_timeout, uint16_t keep_alive_max_requests)
+{
+  this->_keep_alive_timeout = keep_alive_timeout;
+  this->_keep_alive_max_requests = keep_alive_max_requests;
+}
+
+void HttpWebServer::enable_rate_limit(uint8_t rate_limit_burst, uint16_t rate_limit_interval)
+{
+  this->_rate_limit_burst = rate_limit_burst;
+  this->_rate_limit_interval = rate_limit_interval;
+}
+
+void HttpWebServer::enable_websockets(HttpWebSocketHandler websocket_handler)
+{
+  this->_websocket_handler = websocket_handler;
+}
+
 #ifdef ENABLE_HTTP_SERVER_APIKEY_HEADER_AUTH
 void HttpWebServer::enable_apikey_header_auth(const char *apikey_header)
 {
@@ -79,640 +229,1620 @@ void HttpWebServer::enable_apikey_header_auth(const char *apikey_header)
 #endif
 
 #ifdef ENABLE_HTTP_SERVER_OAUTH_AUTH
-void HttpWebServer::enable_oauth_auth(UDP &udp, const char *oauth_consumer_key, const char *oauth_consumer_secret, uint16_t oauth_nonce_size, uint16_t oauth_nonce_history, uint16_t oauth_timestamp_validity_window)
+void HttpWebServer::enable_oauth_auth(UDP &udp, const char *oauth_consumer_key, const char *oauth_consumer_secret, uint16_t oauth_nonce_history, uint32_t oauth_timestamp_validity_window)
 {
   this->_udp = &udp;
   this->_oauth_consumer_key = oauth_consumer_key;
   this->_oauth_consumer_secret = oauth_consumer_secret;
-  this->_oauth_nonce_size = oauth_nonce_size;
   this->_oauth_nonce_history = oauth_nonce_history;
   this->_oauth_timestamp_validity_window = oauth_timestamp_validity_window;
 
-  // Initialise nonce history storage
+  // Initialise nonce history storage, a ring of nonce fingerprints and a hash table of ring positions at most half full, in one block
+  size_t oauth_nonce_slots = 1;
+
+  while (oauth_nonce_slots < (2 * (size_t)this->_oauth_nonce_history)) {
+    oauth_nonce_slots <<= 1;
+  }
+
   this->_oauth_nonce_index = 0;
-  this->_oauth_nonces = (char **)malloc(this->_oauth_nonce_history * sizeof(char *));
+  this->_oauth_nonce_count = 0;
+  this->_oauth_nonce_slot_mask = oauth_nonce_slots - 1;
+  this->_oauth_nonces = (uint64_t *)calloc(1, (this->_oauth_nonce_history * (sizeof(uint64_t) + sizeof(uint32_t))) + (oauth_nonce_slots * sizeof(uint16_t)));
 
   if (this->_oauth_nonces == NULL) {
     LOGPRINTLN_ERROR("FATAL ERROR - Failed to allocate memory for nonce history");
     noInterrupts();
 
     while (true); // Kill program
-  } else {
-    for (int i = 0; i < this->_oauth_nonce_history; i++) {
-      this->_oauth_nonces[i] = (char *)calloc(this->_oauth_nonce_size + 1, sizeof(char));
+  }
 
-      if (this->_oauth_nonces[i] == NULL) {
-        LOGPRINTLN_ERROR("FATAL ERROR - Failed to allocate memory for nonce history");
-        noInterrupts();
+  this->_oauth_nonce_timestamps = (uint32_t *)(this->_oauth_nonces + this->_oauth_nonce_history);
+  this->_oauth_nonce_slots = (uint16_t *)(this->_oauth_nonce_timestamps + this->_oauth_nonce_history);
 
-        while (true); // Kill program
-      }
-    }
-  }
+  // Hash the signing key pads once, each signature check then resumes from them (the token secret is not used so is empty)
+  size_t oauth_consumer_secret_length = strlen(oauth_consumer_secret);
+
+  size_t oauth_consumer_secret_encoded_size = percent_encode(oauth_consumer_secret, oauth_consumer_secret_length, NULL, NULL);
+  char oauth_signing_key[oauth_consumer_secret_encoded_size + 1];
+  size_t oauth_signing_key_length = percent_encode(oauth_consumer_secret, oauth_consumer_secret_length, oauth_signing_key, oauth_consumer_secret_encoded_size) - 1;
+  oauth_signing_key[oauth_signing_key_length] = '&';
+  oauth_signing_key_length++;
+
+  Sha1.initHmac((uint8_t *)oauth_signing_key, oauth_signing_key_length);
+  Sha1.saveHmac(this->_oauth_hmac_sha1);
+  Sha256.initHmac((uint8_t *)oauth_signing_key, oauth_signing_key_length);
+  Sha256.saveHmac(this->_oauth_hmac_sha256);
 }
 #endif
 
-void HttpWebServer::poll(Client &client, uint16_t (*request_handler)(Client &, const char *, const char *, HashMap<char *, char *, 24> &))
+void HttpWebServer::poll(HttpRequestHandler request_handler)
 {
   LOGPRINTLN_TRACE("Entered HttpWebServer::poll()");
 #ifdef ENABLE_HTTP_SERVER_OAUTH_AUTH  
   LOGPRINTLN_TRACE("Calling HttpWebServer::clock.update()");
   this->clock->update();
 #endif
-  if (!client) {
-    return;
-  }
-
-  long request_index = 0;
-  bool authorised = true;
-  long request_complete = false;
-  bool current_line_empty = true;
-  unsigned long connected_since = millis();
-  char request[this->_request_buffer_size];
-
-  LOGPRINTLN_VERBOSE("Entering loop client.conected()");
 
-  while (client.connected()) {
-    LOGPRINTLN_TRACE("Entered loop client.conected()");
+  // Accept every waiting client into a free connection slot, or turn it away when all are in use
+  // (bounded, WiFi101 hands out clients already being serviced that have data available too)
+  this->_accept_queue_depth = 0;
 
-    // Has request timed out?
-    unsigned long time_now = millis();
+  for (int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
+    WiFiClient client = this->_server->available();
+    HttpConnection *accepted_connection = NULL;
 
-    if (((time_now - connected_since) >= this->_request_timeout)) {
-      LOGPRINTLN_VERBOSE("Request timed out");
+    if (!client || !this->_accept(client, accepted_connection)) {
       break;
     }
 
-    // Is data available?
-    LOGPRINTLN_TRACE("Calling client.available()");
+    this->_accept_queue_depth++;
 
-    if (!client.available()) {
-      continue;
+    if (accepted_connection != NULL) {
+      // Serve whatever has already arrived, so requests sent in full don't count as incomplete for the next client
+      this->_poll_connection(*accepted_connection, request_handler);
     }
+  }
+
+  if (this->_accept_queue_depth > this->_accept_queue_peak) {
+    this->_accept_queue_peak = this->_accept_queue_depth;
+    LOGPRINT_DEBUG("Accept queue depth peaked at ");
+    LOGPRINTLN_DEBUG(this->_accept_queue_peak);
+  }
 
-    char c = client.read();
+  // Service each active connection in turn, rotating which goes first
+  for (int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
+    HttpConnection &connection = this->_connections[(this->_connection_next + i) % HTTP_SERVER_MAX_CONNECTIONS];
 
-    if (request_index < (sizeof(request) - 1)) {
-      request[request_index] = c;
-      request_index++;
+    if (connection.client) {
+      this->_poll_connection(connection, request_handler);
     }
+  }
 
-    // Is request complete?
-    request_complete = (current_line_empty && c == '\n');
+  this->_connection_next = (this->_connection_next + 1) % HTTP_SERVER_MAX_CONNECTIONS;
+}
 
-    if (c == '\n') {
-      current_line_empty = true;
-    } else if (c != '\r') {
-      current_line_empty = false;
-    }
+bool HttpWebServer::_accept(WiFiClient &client, HttpConnection *&accepted_connection)
+{
+  HttpConnection *free_connection = NULL;
+  HttpConnection *idle_connection = NULL;
+  HttpConnection *incomplete_connection = NULL;
+  uint8_t incomplete_connections = 0;
 
-    if (!request_complete) {
-      continue;
+  for (int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
+    HttpConnection &connection = this->_connections[i];
+
+    if (!connection.client) {
+      if (free_connection == NULL) {
+        free_connection = &connection;
+      }
+    } else if ((client.remoteIP() == connection.client.remoteIP()) && (client.remotePort() == connection.client.remotePort())) {
+      return false; // Already being serviced (WiFi101 hands out clients with data available, not just new ones)
+    } else if ((connection.stream == HWS_STREAM_NONE) && (connection.request_count > 0) && (connection.request_index == 0)) {
+      if ((idle_connection == NULL) || ((long)(connection.request_since - idle_connection->request_since) < 0)) {
+        idle_connection = &connection;
+      }
+    } else if ((connection.stream == HWS_STREAM_NONE) && ((millis() - connection.request_since) >= (((connection.request_index == 0) ? HTTP_REQUEST_FIRST_BYTE_TIMEOUT : HTTP_REQUEST_HEADER_TIMEOUT) / 2))) {
+      // Only counted as slow once half its first byte or header deadline has gone, a client just accepted is still on time
+      incomplete_connections++;
+
+      if ((incomplete_connection == NULL) || ((long)(connection.request_since - incomplete_connection->request_since) < 0)) {
+        incomplete_connection = &connection;
+      }
     }
+  }
 
-    request[request_index] = 0;
-    LOGPRINTLN_VERBOSE("Complete HTTP request received");
+  if (!this->_admit(client.remoteIP())) {
+    LOGPRINTLN_DEBUG("Client over its rate limit, turning away client");
+    this->_auth_rejects[HTTP_AUTH_STAGE_CLIENT]++;
+    this->send_response(client, 429);
+    delay(1);
+    client.stop();
+    return true;
+  }
+
+  if ((free_connection == NULL) && (incomplete_connections >= HTTP_SERVER_MAX_INCOMPLETE_CONNECTIONS)) {
+    // Slow clients can't hold every connection, the one waiting longest for its request makes way
+    LOGPRINTLN_DEBUG("Too many slow requests, closing longest waiting connection");
+    this->_close(*incomplete_connection);
+    free_connection = incomplete_connection;
+  }
+
+  if ((free_connection == NULL) && (idle_connection != NULL)) {
+    LOGPRINTLN_DEBUG("All connections busy, closing longest idle keep-alive connection");
+    this->_close(*idle_connection);
+    free_connection = idle_connection;
+  }
+
+  if (free_connection == NULL) {
+    LOGPRINTLN_DEBUG("All connections busy, turning away client");
+    this->send_response(client, 503);
+    delay(1);
+    client.stop();
+    return true;
+  }
 
-    // Start HTTP request processing
-    // Extract and split HTTP request line
-    LOGPRINTLN_DEBUG(request);
-    LOGPRINTLN_VERBOSE("Extract and split HTTP request line");
+  LOGPRINT_INFO("\nAccepted new client connection from ");
+  LOGPRINT_INFO((IPAddress)client.remoteIP());
+  LOGPRINT_INFO(":");
+  LOGPRINTLN_INFO(client.remotePort());
+
+  free_connection->client = client;
+  free_connection->request_count = 0;
+  free_connection->stream = HWS_STREAM_NONE;
+  this->_reset_parser(*free_connection);
+  accepted_connection = free_connection;
+  return true;
+}
 
-    char *request_line_end = strstr(request, "\r\n");
-    size_t request_line_length = request_line_end - request;
-    char request_line_temp[request_line_length + 1];
-    memcpy(request_line_temp, request, request_line_length);
-    request_line_temp[request_line_length] = 0;
+bool HttpWebServer::_admit(uint32_t address)
+{
+  // Token bucket per client address, each connection and each further request on it takes a token, one is restored every interval
+  if (this->_rate_limit_burst == 0) {
+    return true;
+  }
 
-    char *request_method = strtok(request_line_temp, " ");
-    char *request_url = strtok(NULL, " ");
-    char *request_query = strstr(request_url, "?");
+  unsigned long time_now = millis();
+  HttpClientBucket *bucket = NULL;
+  HttpClientBucket *oldest_bucket = &this->_client_buckets[0];
 
-    size_t request_query_length = 0;
+  for (int i = 0; i < HTTP_SERVER_RATE_LIMIT_CLIENTS; i++) {
+    if (this->_client_buckets[i].address == address) {
+      bucket = &this->_client_buckets[i];
+      break;
+    }
 
-    if (request_query != NULL) {
-      *request_query = 0; // Replace the ? with a NULL, request_url now excludes the request_query
+    if ((long)(this->_client_buckets[i].refilled - oldest_bucket->refilled) < 0) {
+      oldest_bucket = &this->_client_buckets[i];
+    }
+  }
 
-      request_query++;
-      request_query_length = strlen(request_query);
+  if (bucket == NULL) {
+    // Unknown address, reuse the bucket refilled longest ago (unused buckets have address 0)
+    bucket = oldest_bucket;
 
-      if (request_query_length <= 0) {
-        request_query_length = 0;
-        request_query = NULL;
+    for (int i = 0; i < HTTP_SERVER_RATE_LIMIT_CLIENTS; i++) {
+      if (this->_client_buckets[i].address == 0) {
+        bucket = &this->_client_buckets[i];
+        break;
       }
     }
 
-    strtoupper(request_method);
-    size_t request_method_length = strlen(request_method);
-    size_t request_url_length = strlen(request_url);
+    bucket->address = address;
+    bucket->tokens = this->_rate_limit_burst;
+    bucket->refilled = time_now;
+
+  } else {
+    unsigned long refill = (time_now - bucket->refilled) / this->_rate_limit_interval;
+
+    if (refill >= (unsigned long)(this->_rate_limit_burst - bucket->tokens)) {
+      bucket->tokens = this->_rate_limit_burst;
+      bucket->refilled = time_now;
+    } else {
+      bucket->tokens += refill;
+      bucket->refilled += (refill * this->_rate_limit_interval);
+    }
+  }
+
+  if (bucket->tokens == 0) {
+    return false;
+  }
+
+  bucket->tokens--;
+  return true;
+}
+
+void HttpWebServer::_poll_connection(HttpConnection &connection, HttpRequestHandler request_handler)
+{
+  // Has client gone away?
+  if (!connection.client.connected()) {
+    LOGPRINTLN_VERBOSE("Client disconnected");
+    this->_close(connection);
+    return;
+  }
+
+  // Is the connection held open for pushed updates?
+  if (connection.stream != HWS_STREAM_NONE) {
+    this->_poll_stream(connection);
+    return;
+  }
 
-    // Extract Host header
-    LOGPRINTLN_VERBOSE("Extract Host header");
-    char host_header_name[] = "Host: ";
-    char host_header_value[64] = { 0 };
-    strcaseextract(request, host_header_name, "\r\n", host_header_value, sizeof(host_header_value));
+  // Has request, or the wait for the next request on a kept alive connection, timed out?
+  bool idle = (connection.request_count > 0) && (connection.request_index == 0);
 
-    char *host_header_value_port = strstr(host_header_value, ":");
+  if ((millis() - connection.request_since) >= (idle ? this->_keep_alive_timeout : this->_request_timeout)) {
+    LOGPRINTLN_VERBOSE(idle ? "Keep-alive connection timed out" : "Request timed out");
+    this->_close(connection);
+    return;
+  }
 
-    if ((this->_port == 80) && (host_header_value_port != NULL)) {
-      *host_header_value_port = '\0';
-    } else if ((this->_port != 80) && (host_header_value_port == NULL)) {
-      char temp[6] = { 0 };
-      temp[0] = ':';
+  // Read whatever is available now straight into the request buffer, the rest of the request is picked up on the next poll
+  // Once the headers are complete reading stops, the handler streams the body from the client with read_body()
+  LOGPRINTLN_TRACE("Calling client.available()");
+  int available;
 
-      sprintf(((char *)temp) + 1, "%d", this->_port);
-      strcat(host_header_value, temp);
+  while ((connection.parser_state < HWS_BODY) && (connection.request_index < (this->_request_buffer_size - 1)) && ((available = connection.client.available()) > 0)) {
+    if (connection.request_index == 0) {
+      connection.request_since = millis(); // Request timeout runs from its first byte
     }
 
-    size_t host_header_value_length = strlen(host_header_value);
+    connection.received_since = millis();
+
+    size_t length = min((size_t)available, (size_t)(this->_request_buffer_size - 1 - connection.request_index));
+    int received = connection.client.read((uint8_t *)connection.request + connection.request_index, length);
 
-    // Is the request valid
-    if ((request_method == NULL) || (request_url == NULL) || (host_header_value_length == 0)) {
-      LOGPRINTLN_DEBUG("Bad request");
-      this->send_response(client, 400);
+    if (received <= 0) {
       break;
     }
 
-    // Map the query string
-    LOGPRINTLN_VERBOSE("Map the query string");
-    HashMap<char *, char *, 24> request_query_map(strcomparator);
-    char request_query_temp[request_query_length + 1];
-
-    if (request_query != NULL) {
-      memcpy(request_query_temp, request_query, request_query_length);
-      request_query_temp[request_query_length] = 0;
+    connection.request_index += received;
+  }
 
-      // Mapping the query string relies on careful use of strtok nulling the key/value pairs and then us nulling the key/value seperators
-      char *query_parameter = strtok(request_query_temp, "&");
+  // Drop clients trickling the request in, the first byte must arrive promptly and then each byte soon after the last
+  if ((connection.request_count == 0) && (connection.request_index == 0) && ((millis() - connection.request_since) >= HTTP_REQUEST_FIRST_BYTE_TIMEOUT)) {
+    LOGPRINTLN_VERBOSE("Request not started in time");
+    this->_close(connection);
+    return;
+  }
 
-      while (query_parameter != NULL) {
-        char *query_parameter_name = query_parameter;
-        char *query_parameter_value = strstr(query_parameter, "=");
+  if ((connection.parser_state < HWS_BODY) && (connection.request_index > 0) && (connection.request_index < (this->_request_buffer_size - 1)) && ((millis() - connection.received_since) >= HTTP_REQUEST_IDLE_TIMEOUT)) {
+    LOGPRINTLN_VERBOSE("Request stalled");
+    this->_close(connection);
+    return;
+  }
 
-        if (query_parameter_value != NULL) {
-          // Null the equal sign, move pointer to next position for start of value
-          *query_parameter_value = 0;
-          query_parameter_value++;
-        } else {
-          // No value, move pointer to end of name position (to get a null terminated empty string)
-          query_parameter_value = query_parameter_name + strlen(query_parameter_name);
-        }
+  // Process every complete request held in the buffer in the order received, the responses go out in the same order
+  while (connection.stream == HWS_STREAM_NONE) {
+    // Scan the newly received bytes for the end of the request line, then the empty line ending the headers
+    while ((connection.parser_state < HWS_BODY) && (connection.scan_index < connection.request_index)) {
+      char c = connection.request[connection.scan_index];
+
+      if ((connection.parser_state == HWS_REQUEST_LINE) && (connection.scan_index == 0) && (c == '\r' || c == '\n')) {
+        // Ignore empty lines preceding the request line
+        connection.request_index--;
+        memmove(connection.request, connection.request + 1, connection.request_index);
+        continue;
+      }
 
-        size_t query_parameter_name_length = strlen(query_parameter_name);
-        size_t query_parameter_value_length = strlen(query_parameter_value);
+      connection.scan_index++;
 
-        if (query_parameter_name_length > 0) {
-          size_t name_decoded_size = percent_decode(query_parameter_name, NULL, NULL);
-          char name_decoded[name_decoded_size];
-          percent_decode(query_parameter_name, name_decoded, sizeof(name_decoded));
-          memcpy(query_parameter_name, name_decoded, sizeof(name_decoded)); // Decoded will always be the same size or less, safe to reinsert
+      if (c == '\n') {
+        if (connection.parser_state == HWS_REQUEST_LINE) {
+          connection.parser_state = HWS_HEADERS;
+          connection.headers_index = connection.scan_index;
+        } else if (connection.current_line_empty) {
+          connection.parser_state = HWS_BODY;
 
-          size_t value_decoded_size = percent_decode(query_parameter_value, NULL, NULL);
-          char value_decoded[value_decoded_size];
-          percent_decode(query_parameter_value, value_decoded, sizeof(value_decoded));
-          memcpy(query_parameter_value, value_decoded, sizeof(value_decoded)); // Decoded will always be the same size or less, safe to reinsert
+          // Terminate the headers in place of the final line feed, leaving any body or pipelined request intact
+          connection.request[connection.scan_index - 1] = 0;
+          LOGPRINTLN_DEBUG(connection.request);
+          this->_index_headers(connection);
 
-          request_query_map[query_parameter_name] = query_parameter_value;
+          if (!this->_parse_body_length(connection)) {
+            this->_close(connection);
+            return;
+          }
         }
 
-        if (request_query_map.willOverflow()) {
-          break;
-        }
+        connection.current_line_empty = true;
+      } else if (c != '\r') {
+        connection.current_line_empty = false;
+      }
+    }
 
-        query_parameter = strtok(NULL, "&");
+    // Are the headers complete?
+    if (connection.parser_state < HWS_BODY) {
+      if (connection.request_index >= (this->_request_buffer_size - 1)) {
+        LOGPRINTLN_DEBUG("Request too large for buffer");
+        this->send_response(connection.client, (connection.parser_state == HWS_REQUEST_LINE) ? 414 : 431);
+        this->_close(connection);
+      } else if ((connection.request_index > 0) && ((millis() - connection.request_since) >= HTTP_REQUEST_HEADER_TIMEOUT)) {
+        LOGPRINTLN_VERBOSE("Request headers not completed in time");
+        this->_close(connection);
       }
+
+      return;
     }
 
-    // Reconstruct complete URL
-    LOGPRINTLN_VERBOSE("Reconstruct complete URL");
-    char request_protocol[] = "http://";
-    size_t request_protocol_length = (sizeof(request_protocol) - 1);
+    // Has the body arrived? The handler reads what came in with the headers from the buffer, then the rest straight from the client
+    uint16_t request_length = connection.scan_index;
+    uint16_t body_buffered = min((uint16_t)(connection.request_index - request_length), connection.content_length);
 
-    size_t request_url_complete_length = request_protocol_length + host_header_value_length + request_url_length;
-    char request_url_complete[request_url_complete_length + 1];
-    char *request_url_complete_ptr = request_url_complete;
+    if ((body_buffered < connection.content_length) && ((body_buffered + connection.client.available()) < connection.content_length)) {
+      return;
+    }
 
-    memcpy(request_url_complete_ptr, request_protocol, request_protocol_length);
-    request_url_complete_ptr += request_protocol_length;
+    connection.parser_state = HWS_COMPLETE;
+    LOGPRINTLN_VERBOSE("Complete HTTP request received");
 
-    memcpy(request_url_complete_ptr, host_header_value, host_header_value_length);
-    request_url_complete_ptr += host_header_value_length;
+    HttpRequest http_request;
+    http_request.body_buffered.data = connection.request + request_length;
+    http_request.body_buffered.length = body_buffered;
+    http_request.body_remaining = connection.content_length;
 
-    memcpy(request_url_complete_ptr, request_url, request_url_length);
-    request_url_complete_ptr += request_url_length;
-    *request_url_complete_ptr = '\0';
+    bool keep_alive = this->_process_request(connection, http_request, request_length, request_handler);
 
-#ifdef ENABLE_HTTP_SERVER_APIKEY_HEADER_AUTH
+    if (!keep_alive) {
+      this->_close(connection);
+      return;
+    }
 
-    // Start API Key header authorisation
-    if (authorised && strlen(this->_apikey_header) > 0) {
-      LOGPRINTLN_VERBOSE("Start API Key header authorisation");
+    // Skip whatever of the body the handler did not read
+    uint8_t body_discard[32];
 
-      char header_name[] = "X-API-Key: ";
-      char header_value[strlen(this->_apikey_header) + 5]; // Larger than the actual key to capture longer attempts
-      strcaseextract(request, header_name, "\r\n", header_value, sizeof(header_value));
+    while (http_request.read_body(body_discard, sizeof(body_discard)) > 0);
 
-      if (authorised && strcmp(this->_apikey_header, header_value) != 0) {
-        authorised = false;
-        LOGPRINTLN_DEBUG("API Key header authorisation FAILURE - header mismatch");
-      }
-    }
+    // Keep the connection alive, ready for the next request, carrying over whatever of it has already been received
+    request_length += body_buffered;
+    uint16_t request_next_length = connection.request_index - request_length;
+    memmove(connection.request, connection.request + request_length, request_next_length);
 
-#endif
+    connection.request_count++;
+    this->_reset_parser(connection);
+    connection.request_index = request_next_length;
+  }
+}
 
-#ifdef ENABLE_HTTP_SERVER_OAUTH_AUTH
+void HttpWebServer::_index_headers(HttpConnection &connection)
+{
+  // One pass over the header block, recording where the value of each known header starts
+  char *headers = connection.request + connection.headers_index;
+  char *headers_end = connection.request + connection.scan_index - 1;
+  char *line = headers;
+  memset(connection.header_offsets, 0, sizeof(connection.header_offsets));
 
-    // Start OAuth authorisation
-    if (authorised && ((strlen(this->_oauth_consumer_key) > 0) || (strlen(this->_oauth_consumer_secret) > 0))) {
-      LOGPRINTLN_VERBOSE("Start OAuth authorisation");
-
-      char *q_oauth_consumer_key;
-      char *q_oauth_signature;
-      char *q_oauth_signature_method;
-      char *q_oauth_timestamp;
-      char *q_oauth_nonce;
-      char *q_oauth_version;
-      char q_oauth_token[] = ""; // Not used
-
-      // Check version matches
-      if (authorised) {
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check parameters");
-        bool oauth_parameters_receieved = request_query_map.contains("oauth_consumer_key") && request_query_map.contains("oauth_signature") && request_query_map.contains("oauth_signature_method") && request_query_map.contains("oauth_timestamp") && request_query_map.contains("oauth_nonce");
-
-        if (!oauth_parameters_receieved) {
-          authorised = false;
-          LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - missing parameters");
-        } else {
-          q_oauth_consumer_key = request_query_map["oauth_consumer_key"];
-          q_oauth_signature = request_query_map["oauth_signature"];
-          q_oauth_signature_method = request_query_map["oauth_signature_method"];
-          q_oauth_timestamp = request_query_map["oauth_timestamp"];
-          q_oauth_nonce = request_query_map["oauth_nonce"];
-          q_oauth_version = request_query_map["oauth_version"];
-        }
-      }
+  while (line < headers_end) {
+    char *line_end = (char *)memchr(line, '\n', headers_end - line);
 
-      // Check version matches
-      if (authorised) {
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check version");
+    if (line_end == NULL) {
+      line_end = headers_end;
+    }
 
-        if ((strcmp(q_oauth_version, "1.0") != 0) && (strcmp(q_oauth_version, "1.0a") != 0)) {
-          authorised = false;
-          LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - version unexpected");
-        }
-      }
+    char *value_end = line_end;
+    char *colon = (char *)memchr(line, ':', line_end - line);
 
-      // Check consumer key matches
-      if (authorised) {
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check consumer key");
+    if ((value_end > line) && (*(value_end - 1) == '\r')) {
+      value_end--;
+    }
 
-        if (strcmp(q_oauth_consumer_key, this->_oauth_consumer_key) != 0) {
-          authorised = false;
-          LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - consumer key mismatch");
-        }
-      }
+    if (colon != NULL) {
+      HttpSpan name = { line, (uint16_t)(colon - line) };
+      uint32_t name_hash = name.hash();
 
-      // Check timestamp within validity range
-      if (authorised) {
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check timestamp");
-        uint32_t timestamp = this->clock->now_utc();
-        uint32_t oauth_timestamp = atol(q_oauth_timestamp);
-        uint32_t oauth_timestamp_difference = max(timestamp, oauth_timestamp) - min(timestamp, oauth_timestamp);
-
-        if ((oauth_timestamp < this->_oauth_timestamp_last) || (oauth_timestamp < 1500000000) || (oauth_timestamp_difference > (this->_oauth_timestamp_validity_window / 1000))) {
-          authorised = false;
-          LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - timestamp invalid");
-        } else {
-          this->_oauth_timestamp_last = oauth_timestamp;
+      for (uint8_t i = 0; i < HTTP_HEADER_COUNT; i++) {
+        if ((HWS_HEADER_HASHES[i] != name_hash) || !name.equals_ignore_case(HWS_HEADER_NAMES[i])) {
+          continue;
         }
-      }
 
-      // Check the nonce hasn't been used previously
-      if (authorised) {
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check nonce");
+        if (connection.header_offsets[i] == 0) {
+          // First occurrence wins, the value is trimmed and null terminated in place
+          char *value = colon + 1;
+
+          while ((value < value_end) && ((*value == ' ') || (*value == '\t'))) {
+            value++;
+          }
 
-        for (int i = 0; i < this->_oauth_nonce_history; i++) {
-          if (strncmp(q_oauth_nonce, this->_oauth_nonces[i], this->_oauth_nonce_size) == 0) {
-            authorised = false;
-            LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - nonce reused");
-            break;
+          while ((value_end > value) && ((*(value_end - 1) == ' ') || (*(value_end - 1) == '\t'))) {
+            value_end--;
           }
+
+          *value_end = '\0';
+          connection.header_offsets[i] = value - headers;
         }
+
+        break;
       }
+    }
 
-      // Save this nonce to the history
-      if (authorised) {
-        LOGPRINTLN_VERBOSE("OAuth authorisation - save nonce");
-        size_t oauth_nonce_length = min((uint16_t)strlen(q_oauth_nonce), this->_oauth_nonce_size);
-        memset(this->_oauth_nonces[this->_oauth_nonce_index], 0, this->_oauth_nonce_size + 1);
-        memcpy(this->_oauth_nonces[this->_oauth_nonce_index], q_oauth_nonce, oauth_nonce_length);
-        *(this->_oauth_nonces[this->_oauth_nonce_index] + oauth_nonce_length) = 0;
+    line = line_end + 1;
+  }
+}
 
-        this->_oauth_nonce_index++;
+bool HttpWebServer::_parse_body_length(HttpConnection &connection)
+{
+  const char *headers = connection.request + connection.headers_index;
+  connection.content_length = 0;
 
-        if (this->_oauth_nonce_index >= this->_oauth_nonce_history) {
-          this->_oauth_nonce_index = 0;
-        }
-      }
+  if (connection.header_offsets[HTTP_HEADER_TRANSFER_ENCODING] != 0) {
+    LOGPRINTLN_DEBUG("Request body transfer encoding not supported");
+    this->send_response(connection.client, 501);
+    return false;
+  }
 
-      // Check signature
-      if (authorised) {
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check signature");
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, gather parameters");
-        // Gather all parameters in the correct lexicographic order
-        int parameter_index = 0;
-        int parameter_key_value_length = 0;
-        char *parameters[request_query_map.size() - 1];
-        int parameters_length = (sizeof(parameters) / sizeof(parameters[0]));
-
-        for (int i = 0; i < request_query_map.size(); i++) {
-          char *key = request_query_map.keyAt(i);
-          char *value = request_query_map.valueAt(i);
-
-          if (strcmp(key, "oauth_signature") != 0) {
-            parameter_key_value_length += (strlen(key) + strlen(value));
-            parameters[parameter_index] = key;
-            parameter_index++;
-          }
+  if (connection.header_offsets[HTTP_HEADER_CONTENT_LENGTH] == 0) {
+    return true; // No body
+  }
 
-          if (parameter_index > (parameters_length - 1)) {
-            break;
-          }
-        }
+  const char *content_length_header_value = headers + connection.header_offsets[HTTP_HEADER_CONTENT_LENGTH];
 
-        array_sort(parameters, parameters_length);
+  char *content_length_end;
+  unsigned long content_length = strtoul(content_length_header_value, &content_length_end, 10);
 
-        // Build the parameter string
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, build parameter string");
-        char oauth_parameter_string[((parameter_key_value_length * 2) + (parameters_length * 2) - 1) + 1]; // parameter_key_value_length * 2 should be enough, otherwise the encoded output won't be the full input
-        char *oauth_parameter_string_ptr = oauth_parameter_string;
+  if ((*content_length_end != '\0') || !isdigit(content_length_header_value[0])) {
+    LOGPRINTLN_DEBUG("Request body length invalid");
+    this->send_response(connection.client, 400);
+    return false;
+  }
+
+  if (content_length > HTTP_REQUEST_MAX_BODY_SIZE) {
+    LOGPRINTLN_DEBUG("Request body too large");
+    this->send_response(connection.client, 413);
+    return false;
+  }
 
-        for (int i = 0; i < parameters_length; i++) {
-          char *key = parameters[i];
-          size_t key_length = strlen(key);
+  connection.content_length = content_length;
+  return true;
+}
 
-          size_t key_encoded_size = percent_encode(key, key_length, NULL, NULL);
-          char key_encoded[key_encoded_size];
-          percent_encode(key, key_length, key_encoded, sizeof(key_encoded));
-          size_t key_encoded_length = strlen(key_encoded);
+void HttpWebServer::_reset_parser(HttpConnection &connection)
+{
+  connection.parser_state = HWS_REQUEST_LINE;
+  connection.request_index = 0;
+  connection.scan_index = 0;
+  connection.content_length = 0;
+  connection.current_line_empty = true;
+  connection.request_since = millis();
+  connection.received_since = connection.request_since;
+}
 
-          char *value = request_query_map[key];
-          size_t value_length = strlen(value);
+void HttpWebServer::_poll_stream(HttpConnection &connection)
+{
+  if (connection.stream == HWS_STREAM_WEBSOCKET) {
+    this->_poll_websocket(connection);
 
-          size_t value_encoded_size = percent_encode(value, value_length, NULL, NULL);
-          char value_encoded[value_encoded_size];
-          percent_encode(value, value_length, value_encoded, sizeof(value_encoded));
-          size_t value_encoded_length = strlen(value_encoded);
+    if (connection.stream == HWS_STREAM_NONE) {
+      return; // Closed
+    }
+  }
 
-          memcpy(oauth_parameter_string_ptr, key_encoded, key_encoded_length);
-          oauth_parameter_string_ptr += key_encoded_length;
-          *oauth_parameter_string_ptr = '=';
-          oauth_parameter_string_ptr++;
+  if ((millis() - connection.request_since) < ((connection.stream == HWS_STREAM_LONG_POLL) ? connection.stream_timeout : HTTP_EVENT_STREAM_HEARTBEAT)) {
+    return;
+  }
 
-          memcpy(oauth_parameter_string_ptr, value_encoded, value_encoded_length);
-          oauth_parameter_string_ptr += value_encoded_length;
-          *oauth_parameter_string_ptr = '&';
-          oauth_parameter_string_ptr++;
-        }
+  if (connection.stream == HWS_STREAM_EVENTS) {
+    // Comment line keeps intermediaries from timing out the stream, and lets a dead client be noticed
+    LOGPRINTLN_TRACE("Sending event stream heartbeat");
+    connection.client.write((const uint8_t *)":\n\n", 3);
+    connection.request_since = millis();
 
-        *oauth_parameter_string_ptr--;
-        *oauth_parameter_string_ptr = '\0';
-
-        size_t oauth_parameter_string_length = strlen(oauth_parameter_string);
-
-        // Percent encode the complete URL (without querystring)
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, percent encode complete url");
-        size_t request_url_encoded_size = percent_encode(request_url_complete, request_url_complete_length, NULL, NULL);
-        char request_url_encoded[request_url_encoded_size];
-        percent_encode(request_url_complete, request_url_complete_length, request_url_encoded, sizeof(request_url_encoded));
-        size_t request_url_encoded_length = strlen(request_url_encoded);
-
-        // Percent encode the parameter string
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, percent encode parameter string");
-        size_t oauth_parameter_string_encoded_size = percent_encode(oauth_parameter_string, oauth_parameter_string_length, NULL, NULL);
-        char oauth_parameter_string_encoded[oauth_parameter_string_encoded_size];
-        percent_encode(oauth_parameter_string, oauth_parameter_string_length, oauth_parameter_string_encoded, sizeof(oauth_parameter_string_encoded));
-        size_t oauth_parameter_string_encoded_length = strlen(oauth_parameter_string_encoded);
-
-        // Build the signature string
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, build signature string");
-        size_t oauth_signature_length = request_method_length + 1 + request_url_encoded_length + 1 + oauth_parameter_string_encoded_length;
-        char oauth_signature[oauth_signature_length + 1];
-        char *oauth_signature_ptr = oauth_signature;
-
-        memcpy(oauth_signature_ptr, request_method, request_method_length);
-        oauth_signature_ptr += request_method_length;
-        *oauth_signature_ptr = '&';
-        oauth_signature_ptr++;;
-
-        memcpy(oauth_signature_ptr, request_url_encoded, request_url_encoded_length);
-        oauth_signature_ptr += request_url_encoded_length;
-        *oauth_signature_ptr = '&';
-        oauth_signature_ptr++;;
-
-        memcpy(oauth_signature_ptr, oauth_parameter_string_encoded, oauth_parameter_string_encoded_length);
-        oauth_signature_ptr += oauth_parameter_string_encoded_length;
-        *oauth_signature_ptr = '\0';
-
-        // Percent encode the consumer secret
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, percent encode consumer secret");
-        const char *oauth_consumer_secret = this->_oauth_consumer_secret;
-        size_t oauth_consumer_secret_length = strlen(oauth_consumer_secret);
-
-        size_t oauth_consumer_secret_encoded_size = percent_encode(oauth_consumer_secret, oauth_consumer_secret_length, NULL, NULL);
-        char oauth_consumer_secret_encoded[oauth_consumer_secret_encoded_size];
-        percent_encode(oauth_consumer_secret, oauth_consumer_secret_length, oauth_consumer_secret_encoded, sizeof(oauth_consumer_secret_encoded));
-        size_t oauth_consumer_secret_encoded_length = strlen(oauth_consumer_secret_encoded);
-
-        // Percent encode the token secret
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, percent encode token secret");
-        char oauth_token_secret[] = ""; // Not used
-        size_t oauth_token_secret_length = strlen(oauth_token_secret);
-
-        size_t oauth_token_secret_encoded_size = percent_encode(oauth_token_secret, oauth_token_secret_length, NULL, NULL);
-        char oauth_token_secret_encoded[oauth_token_secret_encoded_size];
-        percent_encode(oauth_token_secret, oauth_token_secret_length, oauth_token_secret_encoded, sizeof(oauth_token_secret_encoded));
-        size_t oauth_token_secret_encoded_length = strlen(oauth_token_secret_encoded);
-
-        // Build the signing key string
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, build signature key secret");
-        size_t oauth_signing_key_length = oauth_consumer_secret_encoded_length + 1 + oauth_token_secret_encoded_length;
-        char oauth_signing_key[oauth_signing_key_length + 1];
-        char *oauth_signing_key_ptr = oauth_signing_key;
-
-        memcpy(oauth_signing_key_ptr, oauth_consumer_secret_encoded, oauth_consumer_secret_encoded_length);
-        oauth_signing_key_ptr += oauth_consumer_secret_encoded_length;
-        *oauth_signing_key_ptr = '&';
-        oauth_signing_key_ptr++;;
-
-        memcpy(oauth_signing_key_ptr, oauth_token_secret_encoded, oauth_token_secret_encoded_length);
-        oauth_signing_key_ptr += oauth_token_secret_encoded_length;
-        *oauth_signing_key_ptr = '\0';
-
-        // Hash the signature string
-        LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, hash signature string");
-        uint8_t *oauth_signature_hash = NULL;
-        size_t oauth_signature_hash_length = 0;
-
-        if (strcmp(q_oauth_signature_method, "HMAC-SHA1") == 0) {
-          Sha1.initHmac((uint8_t *)oauth_signing_key, oauth_signing_key_length);
-          Sha1.print(oauth_signature);
-          oauth_signature_hash = Sha1.resultHmac(); // The hash result is now stored in hash[0], hash[1] .. hash[19].
-          oauth_signature_hash_length = 20;
-
-        } else if (strcmp(q_oauth_signature_method, "HMAC-SHA256") == 0) {
-          Sha256.initHmac((uint8_t *)oauth_signing_key, oauth_signing_key_length);
-          Sha256.print(oauth_signature);
-          oauth_signature_hash = Sha256.resultHmac(); // The hash result is now stored in hash[0], hash[1] .. hash[31].
-          oauth_signature_hash_length = 32;
-
-        } else {
-          authorised = false;
-        }
+  } else if (connection.stream == HWS_STREAM_WEBSOCKET) {
+    LOGPRINTLN_TRACE("Sending WebSocket ping");
+    HttpWebServer::_send_frame(connection.client, HWS_WS_PING, NULL, 0);
+    connection.request_since = millis();
 
-        // Finally, base64 encode the signature string hash and compare to the signature given
-        if (authorised) {
-          LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, base64 encode signature string hash and compare");
-          size_t oauth_signature_hash_encoded_length = base64_enc_len(oauth_signature_hash_length);
-          char oauth_signature_hash_encoded[oauth_signature_hash_encoded_length + 1];
-          base64_encode(oauth_signature_hash_encoded, (char *)oauth_signature_hash, oauth_signature_hash_length);
-          oauth_signature_hash_encoded[oauth_signature_hash_encoded_length] = 0;
+  } else {
+    // Long poll timed out with nothing new, the client should poll again
+    LOGPRINTLN_VERBOSE("Long poll timed out");
+    HttpWebServer::_send_response(connection.client, 304, NULL, 0, connection.stream_keep_alive, connection.stream_etag, false);
+    this->_end_stream(connection);
+  }
+}
 
-          if (strcmp(q_oauth_signature, (char *)oauth_signature_hash_encoded) != 0) {
-            authorised = false;
-            LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - signature mismatch");
+void HttpWebServer::_poll_websocket(HttpConnection &connection)
+{
+  // Read whatever has arrived behind any frame already buffered
+  int available;
 
-            LOGPRINT_DEBUG("OAuth authorisation - signature string: ");
-            LOGPRINTLN_DEBUG(oauth_signature);
+  while ((connection.request_index < this->_request_buffer_size) && ((available = connection.client.available()) > 0)) {
+    size_t length = min((size_t)available, (size_t)(this->_request_buffer_size - connection.request_index));
+    int received = connection.client.read((uint8_t *)connection.request + connection.request_index, length);
 
-            LOGPRINT_DEBUG("OAuth authorisation - signature hash base64 encoded: ");
-            LOGPRINTLN_DEBUG(oauth_signature_hash_encoded);
-          }
-        }
+    if (received <= 0) {
+      break;
+    }
+
+    connection.request_index += received;
+  }
+
+  // Handle each complete frame, client frames are always masked
+  uint8_t *frame = (uint8_t *)connection.request;
+
+  while (connection.request_index >= 2) {
+    uint8_t opcode = frame[0] & 0x0F;
+    bool final = (frame[0] & 0x80);
+    bool masked = (frame[1] & 0x80);
+    size_t payload_length = frame[1] & 0x7F;
+    size_t header_length = 2;
+
+    if (payload_length == 126) {
+      if (connection.request_index < 4) {
+        return;
       }
+
+      payload_length = (frame[2] << 8) | frame[3];
+      header_length = 4;
+    } else if (payload_length == 127) {
+      payload_length = this->_request_buffer_size; // Never fits, rejected below
     }
 
-#endif // ENABLE_HTTP_SERVER_OAUTH_AUTH
+    size_t frame_length = header_length + 4 + payload_length;
+    const uint8_t *close_reason = NULL;
 
-    if (!authorised) {
-      // Unauthorised
-      LOGPRINTLN_VERBOSE("Unauthorised");
-      this->send_response(client, 401);
-      break;
+    if (!final || !masked) {
+      close_reason = HWS_WS_CLOSE_PROTOCOL_ERROR; // Fragmented messages are not supported
+    } else if (frame_length >= this->_request_buffer_size) {
+      close_reason = HWS_WS_CLOSE_TOO_BIG; // Leaves room to terminate the payload
+    } else if ((opcode != HWS_WS_TEXT) && (opcode != HWS_WS_CLOSE) && (opcode != HWS_WS_PING) && (opcode != HWS_WS_PONG)) {
+      close_reason = HWS_WS_CLOSE_UNSUPPORTED;
+    }
+
+    if (close_reason != NULL) {
+      LOGPRINTLN_DEBUG("Unsupported WebSocket frame, closing");
+      HttpWebServer::_send_frame(connection.client, HWS_WS_CLOSE, close_reason, 2);
+      this->_close(connection);
+      return;
+    }
+
+    if (connection.request_index < frame_length) {
+      return; // Rest of the frame is picked up on the next poll
+    }
+
+    uint8_t *mask = frame + header_length;
+    uint8_t *payload = mask + 4;
+
+    for (size_t i = 0; i < payload_length; i++) {
+      payload[i] ^= mask[i & 3];
+    }
+
+    if (opcode == HWS_WS_TEXT) {
+      uint8_t payload_next = payload[payload_length];
+      payload[payload_length] = 0;
+
+      HttpSpan message = { (char *)payload, (uint16_t)payload_length };
+      uint16_t status = (this->_websocket_handler != NULL) ? this->_websocket_handler(message) : 501;
+      payload[payload_length] = payload_next;
+
+      if (status > 0) {
+        // Reply with the same JSON body as the equivalent HTTP response
+        const HttpStaticResponse *static_response = hws_static_response(status);
+        memcpy_P(hws_response_buffer, static_response->body, static_response->body_length);
+        HttpWebServer::_send_frame(connection.client, HWS_WS_TEXT, hws_response_buffer, static_response->body_length);
+      }
+
+    } else if (opcode == HWS_WS_PING) {
+      HttpWebServer::_send_frame(connection.client, HWS_WS_PONG, payload, payload_length);
+
+    } else if (opcode == HWS_WS_CLOSE) {
+      LOGPRINTLN_VERBOSE("WebSocket closed by client");
+      HttpWebServer::_send_frame(connection.client, HWS_WS_CLOSE, payload, min(payload_length, (size_t)2));
+      this->_close(connection);
+      return;
     }
 
-    // Handle request
-    LOGPRINT_VERBOSE("Handle request ");
-    LOGPRINT_VERBOSE(request_method);
-    LOGPRINT_VERBOSE(" ");
-    LOGPRINTLN_VERBOSE(request_url);
+    // Drop the handled frame, keeping any behind it
+    connection.request_index -= frame_length;
+    memmove(connection.request, connection.request + frame_length, connection.request_index);
+  }
+}
+
+void HttpWebServer::_end_stream(HttpConnection &connection)
+{
+  connection.stream = HWS_STREAM_NONE;
+
+  if (!connection.stream_keep_alive) {
+    this->_close(connection);
+    return;
+  }
+
+  // Back to waiting for the next request, anything pipelined behind the long poll is still in the buffer
+  connection.request_since = millis();
+  connection.received_since = connection.request_since;
+}
+
+void HttpWebServer::publish(const uint8_t *data, size_t length, uint32_t etag)
+{
+  LOGPRINTLN_VERBOSE("Entered HttpWebServer::publish()");
 
-    uint16_t status = request_handler(client, request_method, request_url, request_query_map);
+  for (int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
+    HttpConnection &connection = this->_connections[i];
 
-    if (status > 0) {
-      this->send_response(client, status);
+    if (!connection.client || (connection.stream == HWS_STREAM_NONE)) {
+      continue;
     }
 
-    break;
+    if (connection.stream == HWS_STREAM_EVENTS) {
+      HttpWebServer::_send_event(connection.client, data, length, etag);
+      connection.request_since = millis();
+
+    } else if (connection.stream == HWS_STREAM_WEBSOCKET) {
+      HttpWebServer::_send_frame(connection.client, HWS_WS_TEXT, data, length);
+      connection.request_since = millis();
+
+    } else if (etag != connection.stream_etag) {
+      HttpWebServer::_send_response(connection.client, 200, data, length, connection.stream_keep_alive, etag, false);
+      this->_end_stream(connection);
+    }
   }
+}
+
+uint8_t HttpWebServer::accept_queue_depth()
+{
+  // Clients accepted on the last poll, a depth at the connection limit means clients may have been left waiting
+  return this->_accept_queue_depth;
+}
+
+uint8_t HttpWebServer::accept_queue_peak()
+{
+  return this->_accept_queue_peak;
+}
+
+uint32_t HttpWebServer::auth_rejects(HttpAuthStage stage)
+{
+  // Requests turned away by each authorisation stage since the server started
+  return this->_auth_rejects[stage];
+}
 
-  if (client.connected()) {
+void HttpWebServer::_close(HttpConnection &connection)
+{
+  if (connection.client.connected()) {
     LOGPRINTLN_VERBOSE("Calling client.stop()");
     delay(1);
-    client.stop();
+    connection.client.stop();
     LOGPRINTLN_VERBOSE("Closed client connection");
   }
-}
 
-void HttpWebServer::send_response(Client &client, uint16_t status)
-{
-  HttpWebServer::send_response(client, status, NULL, 0);
+  connection.client = WiFiClient();
+  connection.request_count = 0;
+  connection.stream = HWS_STREAM_NONE;
+  this->_reset_parser(connection);
 }
 
-void HttpWebServer::send_response(Client &client, uint16_t status, const uint8_t *response, size_t size)
+bool HttpWebServer::_process_request(HttpConnection &connection, HttpRequest &http_request, uint16_t request_length, HttpRequestHandler request_handler)
 {
-  LOGPRINTLN_VERBOSE("Entered HttpWebServer::send_response()");
+  Client &client = connection.client;
+  char *request = connection.request;
+
+  // A kept alive connection's first request was paid for when it was accepted, each one after takes a token too
+  if ((connection.request_count > 0) && !this->_admit(connection.client.remoteIP())) {
+    LOGPRINTLN_DEBUG("Client over its rate limit, closing connection");
+    this->_auth_rejects[HTTP_AUTH_STAGE_CLIENT]++;
+    this->send_response(client, 429);
+    return false;
+  }
 
-  const char *status_description;
-  const char *status_message;
+  // Start HTTP request processing
+  http_request.client = &client;
+  http_request.header_offsets = connection.header_offsets;
+  http_request.query_parameter_count = 0;
+  http_request.stream = HWS_STREAM_NONE;
 
-  switch (status) {
-    case 200:
-      status_description = "OK";
-      status_message = "The request has succeeded";
-      break;
+  // Tokenise HTTP request line in place, the spans point into the request buffer and are null terminated
+  LOGPRINTLN_VERBOSE("Tokenise HTTP request line");
+  char *request_line_end = request + connection.headers_index - 1;
 
-    case 202:
-      status_description = "Accepted";
-      status_message = "The request has been accepted.";
-      break;
+  if ((request_line_end > request) && (*(request_line_end - 1) == '\r')) {
+    request_line_end--;
+  }
 
-    case 204:
-      status_description = "No Content";
-      status_message = "The request has been accepted.";
-      break;
+  http_request.headers.data = request + connection.headers_index;
+  http_request.headers.length = request_length - 1 - connection.headers_index;
 
-    case 400:
-      status_description = "Bad Request";
-      status_message = "The requested was bad.";
-      break;
+  char *request_line_ptr = this->_tokenise(request, request_line_end, ' ', http_request.method);
+  request_line_ptr = this->_tokenise(request_line_ptr, request_line_end, ' ', http_request.url);
+  this->_tokenise(request_line_ptr, request_line_end, ' ', http_request.version);
 
-    case 401:
-      status_description = "Unauthorized";
-      status_message = "The requested resource was unauthorised.";
-      break;
+  if ((http_request.method.length == 0) || (http_request.url.length == 0)) {
+    LOGPRINTLN_DEBUG("Bad request");
+    this->send_response(client, 400);
+    return false;
+  }
 
-    case 403:
-      status_description = "Forbidden";
-      status_message = "The requested resource was forbidden.";
-      break;
+  char *request_url_end = (char *)http_request.url.data + http_request.url.length;
+  char *request_query_ptr = this->_tokenise((char *)http_request.url.data, request_url_end, '?', http_request.url); // url now excludes the query
 
-    case 404:
-      status_description = "Not Found";
-      status_message = "The requested resource was not found.";
-      break;
+  strtoupper((char *)http_request.method.data);
+  http_request.method_flag = this->_parse_method(http_request.method);
+  http_request.url_hash = http_request.url.hash();
 
-    case 405:
-      status_description = "Method Not Allowed";
-      status_message = "The requested method was not allowed.";
-      break;
+  // Extract Connection header, keep the connection alive if both ends allow it
+  LOGPRINTLN_VERBOSE("Extract Connection header");
+  const char *connection_header_value = http_request.header(HTTP_HEADER_CONNECTION);
 
-    case 501:
-    default:
-	  status = 501;
-      status_description = "Not Implemented";
-      status_message = "The server does not support the functionality required to fulfil the request.";
-      break;
+  if (connection_header_value == NULL) {
+    connection_header_value = "";
   }
-  
-  const char *success_string;
 
-  if ((status >= 200) && (status <= 299)) {
-    success_string = "true";
+  http_request.keep_alive = (this->_keep_alive_max_requests > 0) && ((connection.request_count + 1) < this->_keep_alive_max_requests);
+
+  if (http_request.version.equals("HTTP/1.0")) {
+    http_request.keep_alive = http_request.keep_alive && (strcasecmp(connection_header_value, "keep-alive") == 0);
   } else {
-    success_string = "false";
+    http_request.keep_alive = http_request.keep_alive && (strcasecmp(connection_header_value, "close") != 0);
+  }
+
+  // Authorisation runs in stages, cheapest first, each rejecting before the next stage's inputs are built
+  // Method stage, a method that can't be routed is refused before anything else is parsed
+  if (http_request.method_flag == HTTP_METHOD_UNKNOWN) {
+    LOGPRINTLN_DEBUG("Authorisation FAILURE - method unknown");
+    this->_auth_rejects[HTTP_AUTH_STAGE_METHOD]++;
+    this->send_response(http_request, 501);
+    return http_request.keep_alive;
   }
 
-  char *head_format = "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nConnection: close\r\n\r\n";
-  char head_buffer[strlen(head_format) + (-2 + 3) + (-2 + strlen(status_description)) + 1];
-  sprintf(head_buffer, head_format, status, status_description);
+  // Extract Host header
+  LOGPRINTLN_VERBOSE("Extract Host header");
+  char host_header_value[64] = { 0 };
+  const char *host_header = http_request.header(HTTP_HEADER_HOST);
+
+  if (host_header != NULL) {
+    // Room is left for a port to be appended, a longer host is refused rather than truncated
+    if (strlen(host_header) > (sizeof(host_header_value) - 7)) {
+      LOGPRINTLN_DEBUG("Host header too large");
+      this->send_response(client, 431);
+      return false;
+    }
 
-  LOGPRINT_DEBUG(head_buffer);
-  client.write((uint8_t *)head_buffer, sizeof(head_buffer) - 1);
+    strcpy(host_header_value, host_header);
+  }
 
-  char *body_format = "{\"result\":%d,\"success\":%s,\"message\":\"%s\"}";
-  char body_buffer[strlen(body_format) + (-2 + 3) + (-2 + strlen(success_string)) + (-2 + strlen(status_message)) + 1];
-  sprintf(body_buffer, body_format, status, success_string, status_message);
+  char *host_header_value_port = strstr(host_header_value, ":");
 
-  if ((response == NULL) || (size <= 0)) {
-    LOGPRINT_DEBUG(body_buffer);
-    response = (uint8_t *)body_buffer;
-    size = sizeof(body_buffer) - 1;
-  } else {
-    LOGPRINT_DEBUG("[response body redacted]");
+  if ((this->_port == 80) && (host_header_value_port != NULL)) {
+    *host_header_value_port = '\0';
+  } else if ((this->_port != 80) && (host_header_value_port == NULL)) {
+    char temp[6] = { 0 };
+    temp[0] = ':';
+
+    sprintf(((char *)temp) + 1, "%d", this->_port);
+    strcat(host_header_value, temp);
   }
 
-  LOGPRINTLN_DEBUG();
-  LOGPRINTLN_DEBUG();
-  client.write(response, size);
-}
\ No newline at end of file
+  size_t host_header_value_length = strlen(host_header_value);
+
+  // Is the request valid
+  if (host_header_value_length == 0) {
+    LOGPRINTLN_DEBUG("Bad request");
+    this->send_response(client, 400);
+    return false;
+  }
+
+#ifdef ENABLE_HTTP_SERVER_APIKEY_HEADER_AUTH
+
+  // API Key stage, a single compare against the indexed header
+  if (strlen(this->_apikey_header) > 0) {
+    LOGPRINTLN_VERBOSE("Start API Key header authorisation");
+
+    const char *header_value = http_request.header(HTTP_HEADER_X_API_KEY);
+
+    if ((header_value == NULL) || (strcmp(this->_apikey_header, header_value) != 0)) {
+      LOGPRINTLN_DEBUG("API Key header authorisation FAILURE - header mismatch");
+      this->_auth_rejects[HTTP_AUTH_STAGE_API_KEY]++;
+      this->send_response(http_request, 401);
+      return http_request.keep_alive;
+    }
+  }
+
+#endif
+
+  // Map the query string, each name and value is percent decoded in place (decoded is always the same size or less)
+  LOGPRINTLN_VERBOSE("Map the query string");
+
+  while ((request_query_ptr < request_url_end) && (http_request.query_parameter_count < HTTP_REQUEST_MAX_QUERY_PARAMETERS)) {
+    HttpSpan query_parameter;
+    request_query_ptr = this->_tokenise(request_query_ptr, request_url_end, '&', query_parameter);
+
+    HttpQueryParameter &parameter = http_request.query_parameters[http_request.query_parameter_count];
+    char *query_parameter_end = (char *)query_parameter.data + query_parameter.length;
+    char *query_parameter_value = this->_tokenise((char *)query_parameter.data, query_parameter_end, '=', parameter.name);
+
+    if (parameter.name.length == 0) {
+      continue;
+    }
+
+    parameter.value.data = query_parameter_value;
+    parameter.value.length = query_parameter_end - query_parameter_value;
+
+    parameter.name.length = percent_decode(parameter.name.data, (char *)parameter.name.data, parameter.name.length + 1) - 1;
+    parameter.value.length = percent_decode(parameter.value.data, (char *)parameter.value.data, parameter.value.length + 1) - 1;
+    http_request.query_parameter_count++;
+  }
+
+#ifdef ENABLE_HTTP_SERVER_OAUTH_AUTH
+
+  // OAuth stages, the consumer, replay and signature checks
+  if ((strlen(this->_oauth_consumer_key) > 0) || (strlen(this->_oauth_consumer_secret) > 0)) {
+    uint16_t status = 401;
+
+    if (!this->_authorise_oauth(http_request, host_header_value, host_header_value_length, status)) {
+      LOGPRINTLN_VERBOSE("Unauthorised");
+      this->send_response(http_request, status);
+      return http_request.keep_alive;
+    }
+  }
+
+#endif // ENABLE_HTTP_SERVER_OAUTH_AUTH
+
+  // Streams are capped so at least one connection is always left for ordinary requests
+  uint8_t streams = 0;
+
+  for (int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
+    if (this->_connections[i].client && (this->_connections[i].stream != HWS_STREAM_NONE)) {
+      streams++;
+    }
+  }
+
+  http_request.stream_available = (streams < HTTP_SERVER_MAX_STREAMS);
+
+  // Handle request
+  LOGPRINT_VERBOSE("Handle request ");
+  LOGPRINT_VERBOSE(http_request.method.data);
+  LOGPRINT_VERBOSE(" ");
+  LOGPRINTLN_VERBOSE(http_request.url.data);
+
+  uint16_t status = request_handler(http_request);
+
+  if (status > 0) {
+    this->send_response(http_request, status);
+  }
+
+  if (http_request.stream != HWS_STREAM_NONE) {
+    // Handler has held the connection open for pushed updates
+    connection.stream = http_request.stream;
+    connection.stream_etag = http_request.stream_etag;
+    connection.stream_timeout = http_request.stream_timeout;
+    connection.stream_keep_alive = http_request.keep_alive && (http_request.method_flag != HTTP_METHOD_HEAD); // The pushed body can't be withheld, so close after it
+    return true;
+  }
+
+  return http_request.keep_alive;
+}
+
+#ifdef ENABLE_HTTP_SERVER_OAUTH_AUTH
+
+uint16_t HttpWebServer::_find_oauth_nonce(uint64_t fingerprint)
+{
+  // Linear probe from the fingerprint's home slot, returns the slot holding it or the empty slot ending the probe
+  uint16_t slot = fingerprint & this->_oauth_nonce_slot_mask;
+
+  while ((this->_oauth_nonce_slots[slot] != 0) && (this->_oauth_nonces[this->_oauth_nonce_slots[slot] - 1] != fingerprint)) {
+    slot = (slot + 1) & this->_oauth_nonce_slot_mask;
+  }
+
+  return slot;
+}
+
+void HttpWebServer::_save_oauth_nonce(uint64_t fingerprint, uint32_t timestamp)
+{
+  if (this->_oauth_nonce_count == this->_oauth_nonce_history) {
+    // History is full, the oldest nonce has an older timestamp than this one (checked before saving) so can't be replayed
+    this->_forget_oauth_nonce();
+  }
+
+  this->_oauth_nonces[this->_oauth_nonce_index] = fingerprint;
+  this->_oauth_nonce_timestamps[this->_oauth_nonce_index] = timestamp;
+  this->_oauth_nonce_slots[this->_find_oauth_nonce(fingerprint)] = this->_oauth_nonce_index + 1;
+  this->_oauth_nonce_index = (this->_oauth_nonce_index + 1) % this->_oauth_nonce_history;
+  this->_oauth_nonce_count++;
+}
+
+uint16_t HttpWebServer::_oldest_oauth_nonce()
+{
+  // Nonces are saved in timestamp order (older timestamps are rejected), so the oldest is also the earliest timestamp
+  return (this->_oauth_nonce_index + this->_oauth_nonce_history - this->_oauth_nonce_count) % this->_oauth_nonce_history;
+}
+
+void HttpWebServer::_forget_oauth_nonce()
+{
+  // Remove the oldest nonce, shifting back any entries probed past its slot
+  uint16_t slot = this->_find_oauth_nonce(this->_oauth_nonces[this->_oldest_oauth_nonce()]);
+  uint16_t next = slot;
+
+  while (true) {
+    next = (next + 1) & this->_oauth_nonce_slot_mask;
+
+    if (this->_oauth_nonce_slots[next] == 0) {
+      break;
+    }
+
+    uint16_t home = this->_oauth_nonces[this->_oauth_nonce_slots[next] - 1] & this->_oauth_nonce_slot_mask;
+
+    if (((next - home) & this->_oauth_nonce_slot_mask) >= ((next - slot) & this->_oauth_nonce_slot_mask)) {
+      this->_oauth_nonce_slots[slot] = this->_oauth_nonce_slots[next];
+      slot = next;
+    }
+  }
+
+  this->_oauth_nonce_slots[slot] = 0;
+  this->_oauth_nonce_count--;
+}
+
+void HttpWebServer::_expire_oauth_nonces(uint32_t timestamp)
+{
+  // Drop the oldest nonces once their timestamps are outside the validity window
+  uint32_t window_start = timestamp - (this->_oauth_timestamp_validity_window / 1000);
+
+  while ((this->_oauth_nonce_count > 0) && (this->_oauth_nonce_timestamps[this->_oldest_oauth_nonce()] < window_start)) {
+    this->_forget_oauth_nonce();
+  }
+}
+
+template <typename HashClass>
+static void hws_hash_percent_encoded(HashClass &hash, const char *data, size_t length, bool twice)
+{
+  // RFC3986 percent encoding written straight into the hash, encoding twice turns each '%' into "%25"
+  for (size_t i = 0; i < length; i++) {
+    uint8_t c = data[i];
+
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c == '-') || (c == '.') || (c == '_') || (c == '~')) {
+      hash.write(c);
+      continue;
+    }
+
+    hash.write('%');
+
+    if (twice) {
+      hash.write('2');
+      hash.write('5');
+    }
+
+    hash.write(chartohex(c >> 4));
+    hash.write(chartohex(c & 0x0F));
+  }
+}
+
+template <typename HashClass>
+static void hws_hash_signature_base_string(HashClass &hash, HttpRequest &http_request, const char *host, size_t host_length, HttpQueryParameter *parameters[], int parameters_length)
+{
+  // METHOD&encoded URL&encoded parameter string, the URL is encoded from its scheme, host and path in turn and the parameter string from encoded names and values
+  for (size_t i = 0; i < http_request.method.length; i++) {
+    hash.write(http_request.method.data[i]);
+  }
+
+  hash.write('&');
+  hws_hash_percent_encoded(hash, "http://", 7, false);
+  hws_hash_percent_encoded(hash, host, host_length, false);
+  hws_hash_percent_encoded(hash, http_request.url.data, http_request.url.length, false);
+  hash.write('&');
+
+  for (int i = 0; i < parameters_length; i++) {
+    if (i > 0) {
+      hws_hash_percent_encoded(hash, "&", 1, false);
+    }
+
+    hws_hash_percent_encoded(hash, parameters[i]->name.data, parameters[i]->name.length, true);
+    hws_hash_percent_encoded(hash, "=", 1, false);
+    hws_hash_percent_encoded(hash, parameters[i]->value.data, parameters[i]->value.length, true);
+  }
+}
+
+bool HttpWebServer::_authorise_oauth(HttpRequest &http_request, const char *host, size_t host_length, uint16_t &status)
+{
+  LOGPRINTLN_VERBOSE("Start OAuth authorisation");
+
+  const HttpSpan *q_oauth_consumer_key = http_request.query_value("oauth_consumer_key");
+  const HttpSpan *q_oauth_signature = http_request.query_value("oauth_signature");
+  const HttpSpan *q_oauth_signature_method = http_request.query_value("oauth_signature_method");
+  const HttpSpan *q_oauth_timestamp = http_request.query_value("oauth_timestamp");
+  const HttpSpan *q_oauth_nonce = http_request.query_value("oauth_nonce");
+  const HttpSpan *q_oauth_version = http_request.query_value("oauth_version");
+
+  // Consumer stage, check parameters were received, the version (optional parameter), consumer key and timestamp
+  LOGPRINTLN_VERBOSE("OAuth authorisation - check consumer");
+  bool oauth_parameters_receieved = (q_oauth_consumer_key != NULL) && (q_oauth_signature != NULL) && (q_oauth_signature_method != NULL) && (q_oauth_timestamp != NULL) && (q_oauth_nonce != NULL);
+
+  if (!oauth_parameters_receieved) {
+    LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - missing parameters");
+    this->_auth_rejects[HTTP_AUTH_STAGE_CONSUMER]++;
+    return false;
+  }
+
+  if ((q_oauth_version != NULL) && !q_oauth_version->equals("1.0") && !q_oauth_version->equals("1.0a")) {
+    LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - version unexpected");
+    this->_auth_rejects[HTTP_AUTH_STAGE_CONSUMER]++;
+    return false;
+  }
+
+  if (!q_oauth_consumer_key->equals(this->_oauth_consumer_key)) {
+    LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - consumer key mismatch");
+    this->_auth_rejects[HTTP_AUTH_STAGE_CONSUMER]++;
+    return false;
+  }
+
+  uint32_t timestamp = this->clock->now_utc();
+  uint32_t oauth_timestamp = atol(q_oauth_timestamp->data);
+  uint32_t oauth_timestamp_difference = max(timestamp, oauth_timestamp) - min(timestamp, oauth_timestamp);
+
+  if ((oauth_timestamp < this->_oauth_timestamp_last) || (oauth_timestamp < 1500000000) || (oauth_timestamp_difference > (this->_oauth_timestamp_validity_window / 1000))) {
+    LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - timestamp invalid");
+    this->_auth_rejects[HTTP_AUTH_STAGE_CONSUMER]++;
+    return false;
+  }
+
+  // Replay stage, check the nonce hasn't been used previously, by its 64 bit fingerprint
+  LOGPRINTLN_VERBOSE("OAuth authorisation - check nonce");
+  uint64_t oauth_nonce_fingerprint = 14695981039346656037ULL;
+  this->_expire_oauth_nonces(timestamp);
+
+  for (uint16_t i = 0; i < q_oauth_nonce->length; i++) {
+    oauth_nonce_fingerprint = (oauth_nonce_fingerprint ^ (uint8_t)q_oauth_nonce->data[i]) * 1099511628211ULL; // FNV-1a
+  }
+
+  if (this->_oauth_nonce_slots[this->_find_oauth_nonce(oauth_nonce_fingerprint)] != 0) {
+    LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - nonce reused");
+    this->_auth_rejects[HTTP_AUTH_STAGE_REPLAY]++;
+    return false;
+  }
+
+  // Signature stage, the base string is only hashed once the cheaper stages have passed
+  LOGPRINTLN_VERBOSE("OAuth authorisation - check signature");
+
+  if (!this->_check_oauth_signature(http_request, host, host_length, *q_oauth_signature_method, *q_oauth_signature)) {
+    this->_auth_rejects[HTTP_AUTH_STAGE_SIGNATURE]++;
+    return false;
+  }
+
+  // A full history may only forget a nonce older than this timestamp, one sharing it could still be replayed
+  if ((this->_oauth_nonce_count == this->_oauth_nonce_history) && (this->_oauth_nonce_timestamps[this->_oldest_oauth_nonce()] >= oauth_timestamp)) {
+    LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - nonce history full");
+    this->_auth_rejects[HTTP_AUTH_STAGE_REPLAY]++;
+    status = 503;
+    return false;
+  }
+
+  // Only a signed request uses up its nonce and moves the timestamp forward
+  this->_save_oauth_nonce(oauth_nonce_fingerprint, oauth_timestamp);
+  this->_oauth_timestamp_last = oauth_timestamp;
+
+  return true;
+}
+
+bool HttpWebServer::_check_oauth_signature(HttpRequest &http_request, const char *host, size_t host_length, const HttpSpan &signature_method, const HttpSpan &signature)
+{
+  LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, gather parameters");
+  // Gather all parameters in the correct lexicographic order
+  int parameter_index = 0;
+  HttpQueryParameter *parameters[HTTP_REQUEST_MAX_QUERY_PARAMETERS];
+
+  for (int i = 0; i < http_request.query_parameter_count; i++) {
+    HttpQueryParameter &parameter = http_request.query_parameters[i];
+
+    if (!parameter.name.equals("oauth_signature")) {
+      parameters[parameter_index] = &parameter;
+      parameter_index++;
+    }
+  }
+
+  int parameters_length = parameter_index;
+  this->_sort_query_parameters(parameters, parameters_length);
+
+  // Hash the signature base string as it is encoded, it is never held in memory
+  LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, hash signature base string");
+  uint8_t *oauth_signature_hash = NULL;
+  size_t oauth_signature_hash_length = 0;
+
+  if (signature_method.equals("HMAC-SHA1")) {
+    Sha1.initHmac(this->_oauth_hmac_sha1);
+    hws_hash_signature_base_string(Sha1, http_request, host, host_length, parameters, parameters_length);
+    oauth_signature_hash = Sha1.resultHmac(); // The hash result is now stored in hash[0], hash[1] .. hash[19].
+    oauth_signature_hash_length = 20;
+
+  } else if (signature_method.equals("HMAC-SHA256")) {
+    Sha256.initHmac(this->_oauth_hmac_sha256);
+    hws_hash_signature_base_string(Sha256, http_request, host, host_length, parameters, parameters_length);
+    oauth_signature_hash = Sha256.resultHmac(); // The hash result is now stored in hash[0], hash[1] .. hash[31].
+    oauth_signature_hash_length = 32;
+
+  } else {
+    return false;
+  }
+
+  // Finally, base64 encode the signature string hash and compare to the signature given
+  LOGPRINTLN_VERBOSE("OAuth authorisation - check signature, base64 encode signature string hash and compare");
+  char oauth_signature_hash_encoded[base64_enc_len(32) + 1];
+  base64_encode(oauth_signature_hash_encoded, (char *)oauth_signature_hash, oauth_signature_hash_length);
+  oauth_signature_hash_encoded[base64_enc_len(oauth_signature_hash_length)] = 0;
+
+  if (!signature.equals(oauth_signature_hash_encoded)) {
+    LOGPRINTLN_DEBUG("OAuth authorisation FAILURE - signature mismatch");
+
+    LOGPRINT_DEBUG("OAuth authorisation - signature hash base64 encoded: ");
+    LOGPRINTLN_DEBUG(oauth_signature_hash_encoded);
+    return false;
+  }
+
+  return true;
+}
+
+#endif
+
+char *HttpWebServer::_tokenise(char *start, char *end, char delimiter, HttpSpan &token)
+{
+  // Span from start up to the delimiter (or end), null terminating it in place, returns the position after the delimiter
+  char *ptr = start;
+
+  while ((ptr < end) && (*ptr != delimiter)) {
+    ptr++;
+  }
+
+  token.data = start;
+  token.length = ptr - start;
+
+  if (ptr < end) {
+    *ptr = '\0';
+    return ptr + 1;
+  }
+
+  *ptr = '\0';
+  return ptr;
+}
+
+HttpMethod HttpWebServer::_parse_method(HttpSpan &method)
+{
+  switch (method.data[0]) {
+    case 'G':
+      return method.equals("GET") ? HTTP_METHOD_GET : HTTP_METHOD_UNKNOWN;
+
+    case 'H':
+      return method.equals("HEAD") ? HTTP_METHOD_HEAD : HTTP_METHOD_UNKNOWN;
+
+    case 'P':
+      return method.equals("PUT") ? HTTP_METHOD_PUT : (method.equals("POST") ? HTTP_METHOD_POST : HTTP_METHOD_UNKNOWN);
+
+    case 'D':
+      return method.equals("DELETE") ? HTTP_METHOD_DELETE : HTTP_METHOD_UNKNOWN;
+
+    case 'O':
+      return method.equals("OPTIONS") ? HTTP_METHOD_OPTIONS : HTTP_METHOD_UNKNOWN;
+
+    default:
+      return HTTP_METHOD_UNKNOWN;
+  }
+}
+
+const HttpRoute *HttpWebServer::find_route(HttpRequest &request, const HttpRoute *routes, size_t routes_length, uint16_t &status)
+{
+  // Routes are in path hash order, a binary search finds the first with the request's hash and only those are verified against the path
+  status = 404;
+  size_t low = 0;
+  size_t high = routes_length;
+
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+
+    if (routes[middle].path_hash < request.url_hash) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  for (size_t i = low; (i < routes_length) && (routes[i].path_hash == request.url_hash); i++) {
+    const HttpRoute *route = &routes[i];
+
+    if (!request.url.equals_ignore_case(route->path)) {
+      continue;
+    }
+
+    if ((route->methods & request.method_flag) == 0) {
+      status = 405; // Path matched, keep looking for a route with this method
+      continue;
+    }
+
+    status = 0;
+    return route;
+  }
+
+  return NULL;
+}
+
+void HttpWebServer::_sort_query_parameters(HttpQueryParameter *parameters[], size_t size)
+{
+  // Insertion sort by name then value, spans are null terminated so can be compared directly
+  for (size_t i = 1; i < size; i++) {
+    HttpQueryParameter *parameter = parameters[i];
+    size_t j = i;
+
+    while (j > 0) {
+      int compare = strcmp(parameters[j - 1]->name.data, parameter->name.data);
+
+      if ((compare < 0) || ((compare == 0) && (strcmp(parameters[j - 1]->value.data, parameter->value.data) <= 0))) {
+        break;
+      }
+
+      parameters[j] = parameters[j - 1];
+      j--;
+    }
+
+    parameters[j] = parameter;
+  }
+}
+
+bool HttpSpan::equals(const char *str) const
+{
+  return (strncmp(this->data, str, this->length) == 0) && (str[this->length] == '\0');
+}
+
+bool HttpSpan::equals_ignore_case(const char *str) const
+{
+  return (strncasecmp(this->data, str, this->length) == 0) && (str[this->length] == '\0');
+}
+
+int HttpRequest::read_body(uint8_t *buffer, size_t size)
+{
+  // Bounded by Content-Length, the part already in the request buffer is read first
+  size = min(size, (size_t)this->body_remaining);
+
+  if (size == 0) {
+    return 0;
+  }
+
+  int length;
+
+  if (this->body_buffered.length > 0) {
+    length = min(size, (size_t)this->body_buffered.length);
+    memcpy(buffer, this->body_buffered.data, length);
+    this->body_buffered.data += length;
+    this->body_buffered.length -= length;
+  } else if ((length = this->client->read(buffer, size)) <= 0) {
+    return 0;
+  }
+
+  this->body_remaining -= length;
+  return length;
+}
+
+uint32_t HttpSpan::hash() const
+{
+  // Must match http_hash()
+  uint32_t hash = 2166136261UL;
+
+  for (uint16_t i = 0; i < this->length; i++) {
+    char c = this->data[i];
+    hash = (hash ^ (uint8_t)(((c >= 'A') && (c <= 'Z')) ? (c + 32) : c)) * 16777619UL;
+  }
+
+  return hash;
+}
+
+const char *HttpRequest::header(HttpHeader name) const
+{
+  uint16_t offset = this->header_offsets[name];
+  return (offset == 0) ? NULL : (this->headers.data + offset);
+}
+
+const HttpSpan *HttpRequest::query_value(const char *name) const
+{
+  for (int i = 0; i < this->query_parameter_count; i++) {
+    if (this->query_parameters[i].name.equals(name)) {
+      return &this->query_parameters[i].value;
+    }
+  }
+
+  return NULL;
+}
+
+void HttpWebServer::send_response(Client &client, uint16_t status)
+{
+  HttpWebServer::_send_response(client, status, NULL, 0, false, 0, false);
+}
+
+void HttpWebServer::send_response(Client &client, uint16_t status, const uint8_t *response, size_t size)
+{
+  HttpWebServer::_send_response(client, status, response, size, false, 0, false);
+}
+
+void HttpWebServer::send_response(HttpRequest &request, uint16_t status)
+{
+  HttpWebServer::_send_response(*request.client, status, NULL, 0, request.keep_alive, 0, (request.method_flag == HTTP_METHOD_HEAD));
+}
+
+void HttpWebServer::send_response(HttpRequest &request, uint16_t status, const uint8_t *response, size_t size)
+{
+  HttpWebServer::_send_response(*request.client, status, response, size, request.keep_alive, 0, (request.method_flag == HTTP_METHOD_HEAD));
+}
+
+void HttpWebServer::send_response(HttpRequest &request, uint16_t status, const uint8_t *response, size_t size, uint32_t etag)
+{
+  HttpWebServer::_send_response(*request.client, status, response, size, request.keep_alive, etag, (request.method_flag == HTTP_METHOD_HEAD));
+}
+
+uint16_t HttpWebServer::begin_event_stream(HttpRequest &request, const uint8_t *data, size_t length, uint32_t etag)
+{
+  LOGPRINTLN_VERBOSE("Entered HttpWebServer::begin_event_stream()");
+
+  if (!request.stream_available) {
+    LOGPRINTLN_DEBUG("Too many streams, turning away event stream");
+    return 503;
+  }
+
+  memcpy_P(hws_response_buffer, HWS_HEAD_EVENT_STREAM, sizeof(HWS_HEAD_EVENT_STREAM) - 1);
+  request.client->write(hws_response_buffer, sizeof(HWS_HEAD_EVENT_STREAM) - 1);
+
+  // Current state is the first event
+  HttpWebServer::_send_event(*request.client, data, length, etag);
+  request.stream = HWS_STREAM_EVENTS;
+  request.stream_etag = etag;
+  return 0;
+}
+
+uint16_t HttpWebServer::begin_long_poll(HttpRequest &request, uint32_t etag, uint16_t timeout)
+{
+  LOGPRINTLN_VERBOSE("Entered HttpWebServer::begin_long_poll()");
+
+  if (!request.stream_available) {
+    LOGPRINTLN_DEBUG("Too many streams, turning away long poll");
+    return 503;
+  }
+
+  request.stream = HWS_STREAM_LONG_POLL;
+  request.stream_etag = etag;
+  request.stream_timeout = timeout;
+  return 0;
+}
+
+uint16_t HttpWebServer::begin_websocket(HttpRequest &request, const uint8_t *data, size_t length, uint32_t etag)
+{
+  LOGPRINTLN_VERBOSE("Entered HttpWebServer::begin_websocket()");
+
+  if (!request.stream_available) {
+    LOGPRINTLN_DEBUG("Too many streams, turning away WebSocket");
+    return 503;
+  }
+
+  const char *upgrade_header_value = request.header(HTTP_HEADER_UPGRADE);
+  const char *version_header_value = request.header(HTTP_HEADER_SEC_WEBSOCKET_VERSION);
+  const char *key_header_value = request.header(HTTP_HEADER_SEC_WEBSOCKET_KEY);
+
+  if ((upgrade_header_value == NULL) || (version_header_value == NULL) || (key_header_value == NULL)) {
+    LOGPRINTLN_DEBUG("WebSocket handshake FAILURE - missing headers");
+    return 400;
+  }
+
+  if ((strcasecmp(upgrade_header_value, "websocket") != 0) || (strcmp(version_header_value, "13") != 0) || (strlen(key_header_value) != 24)) {
+    LOGPRINTLN_DEBUG("WebSocket handshake FAILURE - unsupported headers");
+    return 400;
+  }
+
+  // Accept key is the base64 encoded SHA-1 of the client key and the protocol GUID
+  Sha1.init();
+  Sha1.print(key_header_value);
+  Sha1.print(HWS_WEBSOCKET_GUID);
+
+  char accept[base64_enc_len(20) + 1];
+  base64_encode(accept, (char *)Sha1.result(), 20);
+
+  size_t head_length = sprintf((char *)hws_response_buffer, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+  request.client->write(hws_response_buffer, head_length);
+
+  // Current state is the first frame
+  HttpWebServer::_send_frame(*request.client, HWS_WS_TEXT, data, length);
+  request.stream = HWS_STREAM_WEBSOCKET;
+  request.stream_etag = etag;
+  return 0;
+}
+
+void HttpWebServer::send_chunked_response(HttpRequest &request, uint16_t status, const char *content_type, HttpResponseProducer producer, void *context)
+{
+  LOGPRINTLN_VERBOSE("Entered HttpWebServer::send_chunked_response()");
+  Client &client = *request.client;
+  uint8_t *buffer = hws_response_buffer;
+  size_t length = 0;
+
+  // HTTP/1.0 clients cannot decode chunks, their response is delimited by closing the connection instead
+  bool chunked = !request.version.equals("HTTP/1.0");
+  request.keep_alive = request.keep_alive && chunked;
+
+  // Only the status line of the pre-rendered head is used, it is followed by the JSON content type
+  const HttpStaticResponse *static_response = hws_static_response(status);
+  size_t status_line_length = static_response->status_length - (sizeof("Content-Type: application/json\r\n") - 1);
+  memcpy_P(buffer, static_response->head, status_line_length);
+  length += status_line_length;
+
+  // Content types are short constants, one too long for the buffer is left out rather than overrunning it
+  size_t content_type_length = strlen(content_type);
+
+  if ((length + (sizeof(HWS_CONTENT_TYPE) - 1) + content_type_length + 2 + (sizeof(HWS_TRANSFER_ENCODING_CHUNKED) - 1) + sizeof(HWS_CONNECTION_KEEP_ALIVE)) <= sizeof(hws_response_buffer)) {
+    memcpy_P(buffer + length, HWS_CONTENT_TYPE, sizeof(HWS_CONTENT_TYPE) - 1);
+    length += sizeof(HWS_CONTENT_TYPE) - 1;
+    memcpy(buffer + length, content_type, content_type_length);
+    length += content_type_length;
+    buffer[length++] = '\r';
+    buffer[length++] = '\n';
+  } else {
+    LOGPRINTLN_ERROR("Content type too large for response buffer");
+  }
+
+  if (chunked) {
+    memcpy_P(buffer + length, HWS_TRANSFER_ENCODING_CHUNKED, sizeof(HWS_TRANSFER_ENCODING_CHUNKED) - 1);
+    length += sizeof(HWS_TRANSFER_ENCODING_CHUNKED) - 1;
+  }
+
+  const char *connection = request.keep_alive ? HWS_CONNECTION_KEEP_ALIVE : HWS_CONNECTION_CLOSE;
+  size_t connection_length = request.keep_alive ? (sizeof(HWS_CONNECTION_KEEP_ALIVE) - 1) : (sizeof(HWS_CONNECTION_CLOSE) - 1);
+  memcpy_P(buffer + length, connection, connection_length);
+  length += connection_length;
+
+  buffer[length] = '\0'; // Terminated for logging only
+  LOGPRINT_DEBUG((char *)buffer);
+  LOGPRINTLN_DEBUG("[response body streamed]");
+  client.write(buffer, length);
+
+  if (request.method_flag == HTTP_METHOD_HEAD) {
+    return;
+  }
+
+  // Each chunk is produced after space for its size line, which is then written right aligned against it
+  const size_t chunk_offset = 8;
+
+  while ((length = producer(buffer + chunk_offset, sizeof(hws_response_buffer) - chunk_offset - 2, context)) > 0) {
+    if (!chunked) {
+      client.write(buffer + chunk_offset, length);
+      continue;
+    }
+
+    char chunk_size[chunk_offset + 1];
+    size_t chunk_size_length = sprintf(chunk_size, "%x\r\n", (unsigned int)length);
+    memcpy(buffer + chunk_offset - chunk_size_length, chunk_size, chunk_size_length);
+    buffer[chunk_offset + length] = '\r';
+    buffer[chunk_offset + length + 1] = '\n';
+    client.write(buffer + chunk_offset - chunk_size_length, chunk_size_length + length + 2);
+  }
+
+  if (chunked) {
+    client.write((const uint8_t *)"0\r\n\r\n", 5);
+  }
+}
+
+bool HttpWebServer::not_modified(HttpRequest &request, uint32_t etag)
+{
+  const char *header_value = request.header(HTTP_HEADER_IF_NONE_MATCH);
+
+  if (header_value == NULL) {
+    return false;
+  }
+
+  if (strcmp(header_value, "*") == 0) {
+    return true;
+  }
+
+  // Matches a lone, weak or listed entity tag
+  char etag_value[11];
+  sprintf(etag_value, "\"%08lx\"", (unsigned long)etag);
+  return (strstr(header_value, etag_value) != NULL);
+}
+
+void HttpWebServer::_send_response(Client &client, uint16_t status, const uint8_t *response, size_t size, bool keep_alive, uint32_t etag, bool head)
+{
+  LOGPRINTLN_VERBOSE("Entered HttpWebServer::send_response()");
+
+  const HttpStaticResponse *static_response = hws_static_response(status);
+
+  const char *connection = keep_alive ? HWS_CONNECTION_KEEP_ALIVE : HWS_CONNECTION_CLOSE;
+  size_t connection_length = keep_alive ? (sizeof(HWS_CONNECTION_KEEP_ALIVE) - 1) : (sizeof(HWS_CONNECTION_CLOSE) - 1);
+  uint8_t *buffer = hws_response_buffer;
+  size_t length = 0;
+
+  bool static_body = (status != 204) && (status != 304) && ((response == NULL) || (size <= 0));
+
+  if (status == 204) {
+    // No content, no body
+    memcpy_P(buffer, HWS_HEAD_204, sizeof(HWS_HEAD_204) - 1);
+    length += sizeof(HWS_HEAD_204) - 1;
+    response = NULL;
+
+  } else if (status == 304) {
+    // Not modified, no body
+    memcpy_P(buffer, HWS_HEAD_304, sizeof(HWS_HEAD_304) - 1);
+    length += sizeof(HWS_HEAD_304) - 1;
+    response = NULL;
+
+  } else if (static_body) {
+    // Pre-rendered head and body
+    memcpy_P(buffer, static_response->head, static_response->head_length);
+    length += static_response->head_length;
+
+  } else {
+    // Pre-rendered status line, only the Content-Length is formatted
+    memcpy_P(buffer, static_response->head, static_response->status_length);
+    length += static_response->status_length;
+    length += sprintf((char *)buffer + length, "Content-Length: %u\r\n", (unsigned int)size);
+  }
+
+  if (etag != 0) {
+    length += sprintf((char *)buffer + length, "ETag: \"%08lx\"\r\n", (unsigned long)etag);
+  }
+
+  memcpy_P(buffer + length, connection, connection_length);
+  length += connection_length;
+
+  buffer[length] = '\0'; // Terminated for logging only, the body follows
+  LOGPRINT_DEBUG((char *)buffer);
+
+  if (head) {
+    // HEAD gets the Content-Length of the body it would have had, without the body
+    response = NULL;
+
+  } else if (static_body) {
+    LOGPRINT_DEBUG((const __FlashStringHelper *)static_response->body);
+    memcpy_P(buffer + length, static_response->body, static_response->body_length);
+    length += static_response->body_length;
+
+  } else if (response != NULL) {
+    LOGPRINT_DEBUG("[response body redacted]");
+
+    if ((length + size) <= sizeof(hws_response_buffer)) {
+      memcpy(buffer + length, response, size);
+      length += size;
+      response = NULL;
+    }
+  }
+
+  LOGPRINTLN_DEBUG();
+  LOGPRINTLN_DEBUG();
+  client.write(buffer, length);
+
+  if (response != NULL) {
+    // Body is too large to coalesce, follow the head with a second write
+    client.write(response, size);
+  }
+}
+
+void HttpWebServer::_send_event(Client &client, const uint8_t *data, size_t length, uint32_t etag)
+{
+  uint8_t *buffer = hws_response_buffer;
+  size_t event_length = sprintf((char *)buffer, "id: %08lx\nevent: state\ndata: ", (unsigned long)etag);
+
+  if ((event_length + length + 2) > sizeof(hws_response_buffer)) {
+    // Event is too large to coalesce, follow the head with the data
+    client.write(buffer, event_length);
+    client.write(data, length);
+    client.write((const uint8_t *)"\n\n", 2);
+    return;
+  }
+
+  memcpy(buffer + event_length, data, length);
+  event_length += length;
+  buffer[event_length++] = '\n';
+  buffer[event_length++] = '\n';
+  client.write(buffer, event_length);
+}
+
+void HttpWebServer::_send_frame(Client &client, uint8_t opcode, const uint8_t *data, size_t length)
+{
+  // Server frames are final and unmasked, data may already be in the response buffer
+  uint8_t header[4];
+  size_t header_length = 2;
+  header[0] = 0x80 | opcode;
+
+  if (length < 126) {
+    header[1] = length;
+  } else {
+    header[1] = 126;
+    header[2] = (length >> 8) & 0xFF;
+    header[3] = length & 0xFF;
+    header_length = 4;
+  }
+
+  if ((header_length + length) > sizeof(hws_response_buffer)) {
+    // Frame is too large to coalesce, follow the header with the data
+    client.write(header, header_length);
+    client.write(data, length);
+    return;
+  }
+
+  if (length > 0) {
+    memmove(hws_response_buffer + header_length, data, length);
+  }
+
+  memcpy(hws_response_buffer, header, header_length);
+  client.write(hws_response_buffer, header_length + length);
+}
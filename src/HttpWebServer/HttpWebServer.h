@@ -6,47 +6,266 @@
 #include <Arduino.h>
 #include <Client.h>
 #include <Server.h>
+
+#ifdef ESP8266
+  #include <ESP8266WiFi.h>
+#else
+  #include <WiFi101.h>
+#endif
 #ifdef ENABLE_HTTP_SERVER_OAUTH_AUTH
   #include <Udp.h>
 #endif
 
-#include "../../src/HashMap.h"
 #include "../../src/Utilities/Utilities.h"
+#include "../../src/Sha/sha1.h"
+#include "../../src/Base64/Base64.h"
 
 #ifdef ENABLE_HTTP_SERVER_OAUTH_AUTH
-  #include "../../src/Sha/sha1.h"
   #include "../../src/Sha/sha256.h"
-  #include "../../src/Base64/Base64.h"
   #include "../../src/Clock/Clock.h"
 #endif
 
+#ifndef HTTP_SERVER_MAX_CONNECTIONS
+  #define HTTP_SERVER_MAX_CONNECTIONS 4
+#endif
+
+#ifndef HTTP_SERVER_MAX_STREAMS
+  #define HTTP_SERVER_MAX_STREAMS (HTTP_SERVER_MAX_CONNECTIONS - 1)
+#endif
+
+#ifndef HTTP_RESPONSE_BUFFER_SIZE
+  #define HTTP_RESPONSE_BUFFER_SIZE 512
+#endif
+
+#ifndef HTTP_REQUEST_MAX_BODY_SIZE
+  #define HTTP_REQUEST_MAX_BODY_SIZE 1024
+#endif
+
+#ifndef HTTP_EVENT_STREAM_HEARTBEAT
+  #define HTTP_EVENT_STREAM_HEARTBEAT 15000
+#endif
+
+#ifndef HTTP_REQUEST_MAX_QUERY_PARAMETERS
+  #define HTTP_REQUEST_MAX_QUERY_PARAMETERS 24
+#endif
+
+#ifndef HTTP_SERVER_MAX_INCOMPLETE_CONNECTIONS
+  #define HTTP_SERVER_MAX_INCOMPLETE_CONNECTIONS 2
+#endif
+
+#ifndef HTTP_REQUEST_FIRST_BYTE_TIMEOUT
+  #define HTTP_REQUEST_FIRST_BYTE_TIMEOUT 1000
+#endif
+
+#ifndef HTTP_REQUEST_HEADER_TIMEOUT
+  #define HTTP_REQUEST_HEADER_TIMEOUT 2000
+#endif
+
+#ifndef HTTP_REQUEST_IDLE_TIMEOUT
+  #define HTTP_REQUEST_IDLE_TIMEOUT 500
+#endif
+
+#ifndef HTTP_SERVER_RATE_LIMIT_CLIENTS
+  #define HTTP_SERVER_RATE_LIMIT_CLIENTS 8
+#endif
+
+enum HttpMethod {
+  HTTP_METHOD_UNKNOWN = 0,
+  HTTP_METHOD_GET = (1 << 0),
+  HTTP_METHOD_HEAD = (1 << 1),
+  HTTP_METHOD_POST = (1 << 2),
+  HTTP_METHOD_PUT = (1 << 3),
+  HTTP_METHOD_DELETE = (1 << 4),
+  HTTP_METHOD_OPTIONS = (1 << 5)
+};
+
+// Authorisation stages in the order a request passes through them, cheapest first
+enum HttpAuthStage {
+  HTTP_AUTH_STAGE_CLIENT,
+  HTTP_AUTH_STAGE_METHOD,
+  HTTP_AUTH_STAGE_API_KEY,
+  HTTP_AUTH_STAGE_CONSUMER,
+  HTTP_AUTH_STAGE_REPLAY,
+  HTTP_AUTH_STAGE_SIGNATURE,
+  HTTP_AUTH_STAGE_COUNT
+};
+
+// Case insensitive FNV-1a hash of a path, evaluated at compile time for route tables
+constexpr uint32_t http_hash(const char *str, uint32_t hash = 2166136261UL)
+{
+  return (*str == '\0') ? hash : http_hash(str + 1, (hash ^ (uint8_t)(((*str >= 'A') && (*str <= 'Z')) ? (*str + 32) : *str)) * 16777619UL);
+}
+
+// Headers recorded by the single pass over the header block, HWS_HEADER_NAMES must match this order
+enum HttpHeader {
+  HTTP_HEADER_HOST,
+  HTTP_HEADER_CONNECTION,
+  HTTP_HEADER_CONTENT_LENGTH,
+  HTTP_HEADER_TRANSFER_ENCODING,
+  HTTP_HEADER_X_API_KEY,
+  HTTP_HEADER_IF_NONE_MATCH,
+  HTTP_HEADER_UPGRADE,
+  HTTP_HEADER_SEC_WEBSOCKET_KEY,
+  HTTP_HEADER_SEC_WEBSOCKET_VERSION,
+  HTTP_HEADER_COUNT
+};
+
+// What a connection does once its request has been handled
+enum HttpStreamMode {
+  HWS_STREAM_NONE,
+  HWS_STREAM_EVENTS,
+  HWS_STREAM_LONG_POLL,
+  HWS_STREAM_WEBSOCKET
+};
+
+// A span of the request buffer, tokenised in place so is also null terminated
+struct HttpSpan {
+  const char *data;
+  uint16_t length;
+
+  bool equals(const char *str) const;
+  bool equals_ignore_case(const char *str) const;
+  uint32_t hash() const;
+};
+
+// A route table entry, matched on the path hash then verified against the path itself
+struct HttpRoute {
+  uint8_t methods;
+  uint32_t path_hash;
+  const char *path;
+  uint8_t id;
+};
+
+#define HTTP_ROUTE(methods, path, id) { (methods), http_hash(path), (path), (id) }
+
+// Route tables are binary searched so must be in path hash order, checked at compile time with static_assert
+constexpr bool http_routes_sorted(const HttpRoute *routes, size_t length)
+{
+  return (length < 2) || ((routes[0].path_hash <= routes[1].path_hash) && http_routes_sorted(routes + 1, length - 1));
+}
+
+struct HttpQueryParameter {
+  HttpSpan name;
+  HttpSpan value;
+};
+
+struct HttpRequest {
+  Client *client;
+  HttpSpan method;
+  HttpMethod method_flag;
+  HttpSpan url;
+  uint32_t url_hash;
+  HttpSpan version;
+  HttpSpan headers;
+  const uint16_t *header_offsets;
+  HttpQueryParameter query_parameters[HTTP_REQUEST_MAX_QUERY_PARAMETERS];
+  uint8_t query_parameter_count;
+  bool keep_alive;
+  HttpStreamMode stream;
+  bool stream_available;
+  uint32_t stream_etag;
+  uint16_t stream_timeout;
+  HttpSpan body_buffered;
+  uint16_t body_remaining;
+
+  const HttpSpan *query_value(const char *name) const;
+  const char *header(HttpHeader name) const;
+  int read_body(uint8_t *buffer, size_t size); // Reads the Content-Length body in pieces, returns 0 once it has all been read
+};
+
+typedef uint16_t (*HttpRequestHandler)(HttpRequest &request);
+typedef uint16_t (*HttpWebSocketHandler)(HttpSpan &message);
+typedef size_t (*HttpResponseProducer)(uint8_t *buffer, size_t size, void *context); // Returns 0 once the response is complete
+
 class HttpWebServer
 {
   public:
-    HttpWebServer(Server &server, uint16_t port, uint16_t request_timeout, uint16_t request_buffer_size);
+    HttpWebServer(WiFiServer &server, uint16_t port, uint16_t request_timeout, uint16_t request_buffer_size);
     ~HttpWebServer();
 
+    void enable_keep_alive(uint16_t keep_alive_timeout, uint16_t keep_alive_max_requests);
+    void enable_websockets(HttpWebSocketHandler websocket_handler);
+    void enable_rate_limit(uint8_t rate_limit_burst, uint16_t rate_limit_interval);
+
 #ifdef ENABLE_HTTP_SERVER_APIKEY_HEADER_AUTH
     void enable_apikey_header_auth(const char *apikey_header);
 #endif
 
 #ifdef ENABLE_HTTP_SERVER_OAUTH_AUTH
     Clock *clock;
-    void enable_oauth_auth(UDP &udp, const char *oauth_consumer_key, const char *oauth_consumer_secret, uint16_t oauth_nonce_size, uint16_t oauth_nonce_history, uint16_t oauth_timestamp_validity_window);
+    void enable_oauth_auth(UDP &udp, const char *oauth_consumer_key, const char *oauth_consumer_secret, uint16_t oauth_nonce_history, uint32_t oauth_timestamp_validity_window);
 #endif
 
+    enum ParserState {
+      HWS_REQUEST_LINE,
+      HWS_HEADERS,
+      HWS_BODY,
+      HWS_COMPLETE
+    };
+
+    struct HttpConnection {
+      WiFiClient client;
+      char *request;
+      uint16_t request_index;
+      uint16_t scan_index;
+      uint16_t headers_index;
+      uint16_t content_length;
+      uint16_t header_offsets[HTTP_HEADER_COUNT];
+      bool current_line_empty;
+      unsigned long request_since;
+      unsigned long received_since;
+      uint16_t request_count;
+      ParserState parser_state;
+      HttpStreamMode stream;
+      uint32_t stream_etag;
+      uint16_t stream_timeout;
+      bool stream_keep_alive;
+    };
+
+    struct HttpClientBucket {
+      uint32_t address;
+      uint8_t tokens;
+      unsigned long refilled;
+    };
+
     void begin();
-    void poll(Client &client, uint16_t (*request_handler)(Client &, const char *, const char *, HashMap<char *, char *, 24> &));
+    void poll(HttpRequestHandler request_handler);
     void stop();
+    void publish(const uint8_t *data, size_t length, uint32_t etag);
+    uint8_t accept_queue_depth();
+    uint8_t accept_queue_peak();
+    uint32_t auth_rejects(HttpAuthStage stage);
+
+    static const HttpRoute *find_route(HttpRequest &request, const HttpRoute *routes, size_t routes_length, uint16_t &status);
 
     static void send_response(Client &client, uint16_t status);
     static void send_response(Client &client, uint16_t status, const uint8_t *response, size_t length);
+    static void send_response(HttpRequest &request, uint16_t status);
+    static void send_response(HttpRequest &request, uint16_t status, const uint8_t *response, size_t length);
+    static void send_response(HttpRequest &request, uint16_t status, const uint8_t *response, size_t length, uint32_t etag);
+    static void send_chunked_response(HttpRequest &request, uint16_t status, const char *content_type, HttpResponseProducer producer, void *context); // Streams the producer's output as chunks, for responses too large to build in memory
+    static bool not_modified(HttpRequest &request, uint32_t etag);
+    static uint16_t begin_event_stream(HttpRequest &request, const uint8_t *data, size_t length, uint32_t etag);
+    static uint16_t begin_long_poll(HttpRequest &request, uint32_t etag, uint16_t timeout);
+    static uint16_t begin_websocket(HttpRequest &request, const uint8_t *data, size_t length, uint32_t etag);
 
   private:
-    Server *_server;
+    WiFiServer *_server;
     uint16_t _port;
     uint16_t _request_timeout;
     uint16_t _request_buffer_size;
+    uint16_t _keep_alive_timeout = 0;
+    uint16_t _keep_alive_max_requests = 0;
+    HttpWebSocketHandler _websocket_handler = NULL;
+    uint8_t _rate_limit_burst = 0;
+    uint16_t _rate_limit_interval = 0;
+    HttpClientBucket _client_buckets[HTTP_SERVER_RATE_LIMIT_CLIENTS];
+
+    HttpConnection _connections[HTTP_SERVER_MAX_CONNECTIONS];
+    uint8_t _connection_next;
+    uint8_t _accept_queue_depth = 0;
+    uint8_t _accept_queue_peak = 0;
+    uint32_t _auth_rejects[HTTP_AUTH_STAGE_COUNT] = { 0 };
 
 #ifdef ENABLE_HTTP_SERVER_APIKEY_HEADER_AUTH
     const char *_apikey_header;
@@ -57,14 +276,47 @@ class HttpWebServer
 
     const char *_oauth_consumer_key;
     const char *_oauth_consumer_secret;
-    uint16_t _oauth_nonce_size;
     uint16_t _oauth_nonce_history;
-    uint16_t _oauth_timestamp_validity_window;
+    uint32_t _oauth_timestamp_validity_window;
 
-    char **_oauth_nonces;
+    uint64_t *_oauth_nonces;
+    uint32_t *_oauth_nonce_timestamps;
+    uint16_t *_oauth_nonce_slots;
+    uint16_t _oauth_nonce_slot_mask;
     uint16_t _oauth_nonce_index;
+    uint16_t _oauth_nonce_count;
     uint32_t _oauth_timestamp_last = 0;
+    Sha1Class::hmacState _oauth_hmac_sha1;
+    Sha256Class::hmacState _oauth_hmac_sha256;
 #endif
+
+    bool _accept(WiFiClient &client, HttpConnection *&accepted_connection);
+    bool _admit(uint32_t address);
+    void _poll_connection(HttpConnection &connection, HttpRequestHandler request_handler);
+    void _reset_parser(HttpConnection &connection);
+    void _close(HttpConnection &connection);
+    void _poll_stream(HttpConnection &connection);
+    void _end_stream(HttpConnection &connection);
+    void _poll_websocket(HttpConnection &connection);
+    void _index_headers(HttpConnection &connection);
+    bool _parse_body_length(HttpConnection &connection);
+    bool _process_request(HttpConnection &connection, HttpRequest &http_request, uint16_t request_length, HttpRequestHandler request_handler);
+    char *_tokenise(char *start, char *end, char delimiter, HttpSpan &token);
+    HttpMethod _parse_method(HttpSpan &method);
+    void _sort_query_parameters(HttpQueryParameter *parameters[], size_t size);
+#ifdef ENABLE_HTTP_SERVER_OAUTH_AUTH
+    uint16_t _find_oauth_nonce(uint64_t fingerprint);
+    void _save_oauth_nonce(uint64_t fingerprint, uint32_t timestamp);
+    uint16_t _oldest_oauth_nonce();
+    void _forget_oauth_nonce();
+    void _expire_oauth_nonces(uint32_t timestamp);
+    bool _authorise_oauth(HttpRequest &http_request, const char *host, size_t host_length, uint16_t &status);
+    bool _check_oauth_signature(HttpRequest &http_request, const char *host, size_t host_length, const HttpSpan &signature_method, const HttpSpan &signature);
+#endif
+
+    static void _send_response(Client &client, uint16_t status, const uint8_t *response, size_t length, bool keep_alive, uint32_t etag, bool head);
+    static void _send_event(Client &client, const uint8_t *data, size_t length, uint32_t etag);
+    static void _send_frame(Client &client, uint8_t opcode, const uint8_t *data, size_t length);
 };
 
 #endif // HTTPWEBSERVER_H
\ No newline at end of file
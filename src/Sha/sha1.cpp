@@ -118,6 +118,7 @@ uint8_t* Sha1Class::result(void) {
 
 void Sha1Class::initHmac(const uint8_t* key, int keyLength) {
   uint8_t i;
+  outerState = NULL;
   memset(keyBuffer,0,BLOCK_LENGTH);
   if (keyLength > BLOCK_LENGTH) {
     // Hash long keys
@@ -135,13 +136,39 @@ void Sha1Class::initHmac(const uint8_t* key, int keyLength) {
   }
 }
 
+void Sha1Class::saveHmac(hmacState &hmac) {
+  uint8_t i;
+  // The inner key pad has been hashed by initHmac()
+  memcpy(hmac.inner.b,state.b,HASH_LENGTH);
+  // Hash the outer key pad
+  init();
+  for (i=0; i<BLOCK_LENGTH; i++) write(keyBuffer[i] ^ HMAC_OPAD);
+  memcpy(hmac.outer.b,state.b,HASH_LENGTH);
+  // Carry on with the inner hash
+  initHmac(hmac);
+}
+
+void Sha1Class::initHmac(const hmacState &hmac) {
+  // Resume from the state after one block of key pad
+  memcpy(state.b,hmac.inner.b,HASH_LENGTH);
+  byteCount = BLOCK_LENGTH;
+  bufferOffset = 0;
+  outerState = &hmac.outer;
+}
+
 uint8_t* Sha1Class::resultHmac(void) {
   uint8_t i;
   // Complete inner hash
   memcpy(innerHash,result(),HASH_LENGTH);
   // Calculate outer hash
-  init();
-  for (i=0; i<BLOCK_LENGTH; i++) write(keyBuffer[i] ^ HMAC_OPAD);
+  if (outerState != NULL) {
+    memcpy(state.b,outerState->b,HASH_LENGTH);
+    byteCount = BLOCK_LENGTH;
+    bufferOffset = 0;
+  } else {
+    init();
+    for (i=0; i<BLOCK_LENGTH; i++) write(keyBuffer[i] ^ HMAC_OPAD);
+  }
   for (i=0; i<HASH_LENGTH; i++) write(innerHash[i]);
   return result();
 }
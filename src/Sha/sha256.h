@@ -29,6 +29,25 @@ class Sha256Class : public Print
 	 */
     void initHmac(const uint8_t* secret, int secretLength);
 	
+	/** holds the hash states after the HMAC inner and outer key pads
+	 */
+	struct hmacState {
+		_state inner;
+		_state outer;
+	};
+	
+	/** saves the HMAC key pad states, call straight after initHmac() with the key
+	 *
+	 * @param hmac Where to save the states
+	 */
+    void saveHmac(hmacState &hmac);
+	
+	/** initializes the HMAC process from saved key pad states, the key is not hashed again
+	 *
+	 * @param hmac The states saved by saveHmac()
+	 */
+    void initHmac(const hmacState &hmac);
+	
 	/** Pads the last block and finalizes the hash. 
 	 * 
 	 * @return returns the hash
@@ -125,6 +144,7 @@ class Sha256Class : public Print
     uint32_t byteCount;/**< Byte counter in order to initialize the hash process for a block */
     uint8_t keyBuffer[BLOCK_LENGTH];/**< Hold the key for the HMAC process*/
     uint8_t innerHash[HASH_LENGTH];/**< holds the inner hash for the HMAC process */
+    const _state *outerState;/**< saved outer key pad state for the HMAC process, NULL to hash keyBuffer */
     #if defined(SHA256_LINUX)
 		timeval tv;/**< hold the time value on linux machines (ex Raspberry Pi) */
 	#endif